@@ -0,0 +1,463 @@
+// Native benchmarks for the clustering, histogram and quantization hot paths. Every input comes from a deterministic
+// generator, and every measurement is printed as one JSON object per line so runs can be compared by script.
+#include "clustering.hpp"
+#include "clustering.h"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+namespace Benchmark {
+
+// SplitMix64, so the generated images are identical on every platform and standard library.
+class Random {
+
+private:
+
+    uint64_t state;
+
+public:
+
+    explicit Random(uint64_t seed) : state(seed) {}
+
+    uint64_t next() {
+        uint64_t z = (this->state += 0x9e3779b97f4a7c15ull);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+        return z ^ (z >> 31);
+    }
+
+    uint32_t uniform(uint32_t bound) {
+        return static_cast<uint32_t>(this->next() % bound);
+    }
+
+    // Sum of four uniforms, a cheap bell curve over [-spread, spread].
+    int bell(int spread) {
+        int sum = 0;
+        for (int i = 0; i < 4; i++) {sum += static_cast<int>(this->uniform(2 * spread + 1)) - spread;}
+        return sum / 4;
+    }
+
+};
+
+struct Image {
+    std::string generator;
+    size_t width = 0;
+    size_t height = 0;
+    std::vector<uint8_t> data;
+};
+
+inline uint8_t clamp_channel(int value) {
+    return static_cast<uint8_t>(std::clamp(value, 0, 255));
+}
+
+// Smooth two dimensional ramps, few repeated colours and no noise.
+void generate_gradient(Image& image, Random&) {
+    for (size_t y = 0; y < image.height; y++) {
+        for (size_t x = 0; x < image.width; x++) {
+            uint8_t* pixel = image.data.data() + 4 * (y * image.width + x);
+            pixel[0] = static_cast<uint8_t>(x * 255 / std::max<size_t>(image.width - 1, 1));
+            pixel[1] = static_cast<uint8_t>(y * 255 / std::max<size_t>(image.height - 1, 1));
+            pixel[2] = static_cast<uint8_t>((x + y) * 255 / std::max<size_t>(image.width + image.height - 2, 1));
+        }
+    }
+}
+
+// Uniform noise, the worst case with nearly one distinct colour per pixel.
+void generate_noise(Image& image, Random& random) {
+    for (size_t i = 0; i < image.data.size(); i += 4) {
+        uint64_t bits = random.next();
+        image.data[i + 0] = static_cast<uint8_t>(bits);
+        image.data[i + 1] = static_cast<uint8_t>(bits >> 8);
+        image.data[i + 2] = static_cast<uint8_t>(bits >> 16);
+    }
+}
+
+// Soft regions blended between a handful of dominant colours with sensor-like noise, so colours form dense clusters
+// along a few directions the way they do in photographs.
+void generate_photo(Image& image, Random& random) {
+
+    struct Blob {
+        double x, y, radius;
+        std::array<int, 3> color;
+    };
+
+    std::vector<Blob> blobs(8);
+    for (Blob& blob : blobs) {
+        blob.x = random.uniform(1000) / 1000.0 * image.width;
+        blob.y = random.uniform(1000) / 1000.0 * image.height;
+        blob.radius = (0.1 + random.uniform(1000) / 2500.0) * std::max(image.width, image.height);
+        blob.color = {static_cast<int>(random.uniform(256)), static_cast<int>(random.uniform(256)), static_cast<int>(random.uniform(256))};
+    }
+
+    for (size_t y = 0; y < image.height; y++) {
+        for (size_t x = 0; x < image.width; x++) {
+
+            double total = 1e-9;
+            std::array<double, 3> color = {0.0, 0.0, 0.0};
+            for (const Blob& blob : blobs) {
+                double dx = (x - blob.x) / blob.radius;
+                double dy = (y - blob.y) / blob.radius;
+                double weight = 1.0 / (1e-3 + (dx * dx + dy * dy) * (dx * dx + dy * dy));
+                total += weight;
+                for (size_t c = 0; c < 3; c++) {color[c] += weight * blob.color[c];}
+            }
+
+            uint8_t* pixel = image.data.data() + 4 * (y * image.width + x);
+            int shade = random.bell(6);
+            for (size_t c = 0; c < 3; c++) {pixel[c] = clamp_channel(static_cast<int>(color[c] / total) + shade + random.bell(3));}
+
+        }
+    }
+
+}
+
+// Flat rectangles in a sixteen colour palette, like user interface captures, charts and logos.
+void generate_graphics(Image& image, Random& random) {
+
+    std::vector<std::array<uint8_t, 3>> palette(16);
+    for (std::array<uint8_t, 3>& color : palette) {color = {static_cast<uint8_t>(random.uniform(256)), static_cast<uint8_t>(random.uniform(256)), static_cast<uint8_t>(random.uniform(256))};}
+
+    std::vector<uint8_t> indices(image.width * image.height, 0);
+    for (size_t shape = 0; shape < 64; shape++) {
+        size_t x0 = random.uniform(static_cast<uint32_t>(image.width));
+        size_t y0 = random.uniform(static_cast<uint32_t>(image.height));
+        size_t x1 = std::min(image.width, x0 + 1 + random.uniform(static_cast<uint32_t>(image.width / 3 + 1)));
+        size_t y1 = std::min(image.height, y0 + 1 + random.uniform(static_cast<uint32_t>(image.height / 3 + 1)));
+        uint8_t index = static_cast<uint8_t>(random.uniform(16));
+        for (size_t y = y0; y < y1; y++) {std::fill(indices.begin() + y * image.width + x0, indices.begin() + y * image.width + x1, index);}
+    }
+
+    for (size_t i = 0; i < indices.size(); i++) {
+        std::copy(palette[indices[i]].begin(), palette[indices[i]].end(), image.data.begin() + 4 * i);
+    }
+
+}
+
+// Every image is rgba with opaque alpha, seeded from its generator and size so each one is reproducible on its own.
+Image generate(const std::string& generator, size_t width, size_t height) {
+
+    Image image;
+    image.generator = generator;
+    image.width = width;
+    image.height = height;
+    image.data.assign(4 * width * height, 255);
+
+    // FNV-1a over the name, since std::hash differs between standard libraries.
+    uint64_t seed = 0xcbf29ce484222325ull;
+    for (char c : generator) {seed = (seed ^ static_cast<uint8_t>(c)) * 0x100000001b3ull;}
+    Random random(seed ^ (uint64_t(width) << 32) ^ uint64_t(height));
+
+    if (generator == "gradient") {generate_gradient(image, random);}
+    else if (generator == "noise") {generate_noise(image, random);}
+    else if (generator == "photo") {generate_photo(image, random);}
+    else if (generator == "graphics") {generate_graphics(image, random);}
+    else {throw std::invalid_argument("Benchmark::generate: unknown generator " + generator + ".");}
+
+    return image;
+
+}
+
+struct Settings {
+    std::vector<std::string> generators = {"gradient", "noise", "photo", "graphics"};
+    std::vector<size_t> sizes = {256, 512};
+    size_t repeat = 3;
+    size_t threads = 0;
+    std::string filter;
+};
+
+// Keeps results observable so the optimizer cannot drop the work that produced them.
+volatile uint64_t sink = 0;
+
+class Runner {
+
+private:
+
+    const Settings& settings;
+
+public:
+
+    explicit Runner(const Settings& settings) : settings(settings) {}
+
+    // Times body repeat times after an untimed setup before each run, and prints the fastest and median runs along with
+    // the throughput of the median one.
+    void run(const std::string& name, const Image& image, const std::string& parameter, size_t items, const std::function<void()>& setup, const std::function<void()>& body) {
+
+        if (!this->settings.filter.empty() && name.find(this->settings.filter) == std::string::npos) {return;}
+
+        std::vector<double> samples;
+        for (size_t i = 0; i < this->settings.repeat; i++) {
+            setup();
+            auto start = std::chrono::steady_clock::now();
+            body();
+            samples.push_back(std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count());
+        }
+
+        std::sort(samples.begin(), samples.end());
+        double median = samples[samples.size() / 2];
+        std::printf("{\"benchmark\":\"%s\",\"generator\":\"%s\",\"width\":%zu,\"height\":%zu,\"parameter\":\"%s\",\"items\":%zu,\"repeat\":%zu,\"min_ns\":%.0f,\"median_ns\":%.0f,\"items_per_second\":%.1f}\n",
+            name.c_str(), image.generator.c_str(), image.width, image.height, parameter.c_str(), items, samples.size(), samples.front(), median, items / std::max(median, 1.0) * 1e9);
+        std::fflush(stdout);
+
+    }
+
+};
+
+std::vector<std::array<uint16_t, 3>> distinct_colors(const Image& image) {
+
+    AgglomerativeClustering::PixelHistogram pixels;
+    pixels.count(image.data.data(), image.data.size(), 0);
+
+    std::vector<std::array<uint16_t, 3>> colors;
+    colors.reserve(pixels.size());
+    for (const auto& [key, count] : pixels) {
+        std::array<uint8_t, 3> color = AgglomerativeClustering::PixelHistogram::unpack(key);
+        colors.push_back({static_cast<uint16_t>(color[0] * 257u), static_cast<uint16_t>(color[1] * 257u), static_cast<uint16_t>(color[2] * 257u)});
+    }
+
+    return colors;
+
+}
+
+// Distinct pixels of the image as points of the given coordinate type, taking the first Dimensions channels.
+template<typename Coordinate, size_t Dimensions>
+std::vector<std::array<Coordinate, Dimensions>> distinct_points(const Image& image) {
+
+    std::unordered_set<uint32_t> seen;
+    std::vector<std::array<Coordinate, Dimensions>> points;
+    for (size_t i = 0; i + 3 < image.data.size(); i += 4) {
+        uint32_t key = 0;
+        std::array<Coordinate, Dimensions> point;
+        for (size_t d = 0; d < Dimensions; d++) {
+            key = (key << 8) | image.data[i + d];
+            point[d] = static_cast<Coordinate>(image.data[i + d] * (sizeof(Coordinate) == 1u ? 1u : 257u));
+        }
+        if (seen.insert(key).second) {points.push_back(point);}
+    }
+
+    return points;
+
+}
+
+// The grid engine's merge loop, get_nearest and all, run down to a single cluster.
+template<typename Coordinate, size_t Dimensions>
+size_t merge_all(AgglomerativeClustering::CoarseningGrid<Coordinate, Dimensions>& grid, AgglomerativeClustering::AgglomerativeHistogram<Coordinate, Dimensions>& histogram) {
+
+    while (histogram.size() > 1) {
+        auto result = grid.get_nearest();
+        if (!result.has_value()) {break;}
+        auto [a, b] = result.value();
+        std::array<Coordinate, Dimensions> m = histogram.merge(a, b);
+        grid.remove(a);
+        grid.remove(b);
+        grid.add(m);
+    }
+
+    return histogram.size();
+
+}
+
+// The merge loop on automatically sized grids of other point types: packed 8-bit rgb, and rgba with its 81 bucket
+// neighbourhoods. The generated images are opaque, so rgba measures the cost of the extra dimension alone.
+template<typename Coordinate, size_t Dimensions>
+void run_grid_points(Runner& runner, const Image& image, const std::string& name) {
+
+    std::vector<std::array<Coordinate, Dimensions>> points = distinct_points<Coordinate, Dimensions>(image);
+    std::unique_ptr<AgglomerativeClustering::CoarseningGrid<Coordinate, Dimensions>> grid;
+    AgglomerativeClustering::AgglomerativeHistogram<Coordinate, Dimensions> histogram;
+
+    runner.run("grid_cluster", image, "resolution=auto,point=" + name, points.size(), [&] {
+        grid = std::make_unique<AgglomerativeClustering::CoarseningGrid<Coordinate, Dimensions>>();
+        grid->build(points);
+        histogram = AgglomerativeClustering::AgglomerativeHistogram<Coordinate, Dimensions>();
+        for (const std::array<Coordinate, Dimensions>& point : points) {histogram.count(point);}
+    }, [&] {
+        sink = sink + merge_all(*grid, histogram);
+    });
+
+}
+
+void run_histograms(Runner& runner, const Image& image, size_t threads) {
+
+    size_t pixels = image.width * image.height;
+    std::vector<std::array<uint16_t, 3>> colors = distinct_colors(image);
+
+    runner.run("pixel_histogram", image, "threads=" + std::to_string(threads), pixels, [] {}, [&] {
+        AgglomerativeClustering::PixelHistogram histogram;
+        histogram.count(image.data.data(), image.data.size(), 0, threads);
+        sink = sink + histogram.size();
+    });
+
+    runner.run("agglomerative_histogram_build", image, "", colors.size(), [] {}, [&] {
+        AgglomerativeClustering::AgglomerativeHistogram<> histogram;
+        histogram.reserve(colors.size());
+        for (const std::array<uint16_t, 3>& color : colors) {histogram.count(color);}
+        sink = sink + histogram.size();
+    });
+
+    AgglomerativeClustering::AgglomerativeHistogram<> merged;
+    runner.run("agglomerative_histogram_merge", image, "", colors.size() / 2, [&] {
+        merged = AgglomerativeClustering::AgglomerativeHistogram<>();
+        merged.reserve(colors.size());
+        for (const std::array<uint16_t, 3>& color : colors) {merged.count(color);}
+    }, [&] {
+        for (size_t i = 0; i + 1 < colors.size(); i += 2) {merged.merge(colors[i], colors[i + 1]);}
+        sink = sink + merged.size();
+    });
+
+}
+
+void run_grid(Runner& runner, const Image& image) {
+
+    std::vector<std::array<uint16_t, 3>> colors = distinct_colors(image);
+    std::unique_ptr<AgglomerativeClustering::CoarseningGrid<>> grid;
+
+    runner.run("grid_add", image, "resolution=8", colors.size(), [&] {grid = std::make_unique<AgglomerativeClustering::CoarseningGrid<>>(8u);}, [&] {
+        for (const std::array<uint16_t, 3>& color : colors) {grid->add(color);}
+    });
+
+    runner.run("grid_build", image, "resolution=8", colors.size(), [&] {grid = std::make_unique<AgglomerativeClustering::CoarseningGrid<>>(8u);}, [&] {
+        grid->build(colors);
+    });
+
+    runner.run("grid_remove", image, "resolution=8", colors.size(), [&] {
+        grid = std::make_unique<AgglomerativeClustering::CoarseningGrid<>>(8u);
+        grid->build(colors);
+    }, [&] {
+        for (const std::array<uint16_t, 3>& color : colors) {grid->remove(color);}
+    });
+
+    // The whole merge loop of the grid engine, get_nearest and all, for the automatic and a sweep of fixed starting resolutions.
+    for (int resolution : {-1, 4, 6, 8, 10, 12}) {
+        AgglomerativeClustering::AgglomerativeHistogram<> histogram;
+        runner.run("grid_cluster", image, "resolution=" + (resolution < 0 ? std::string("auto") : std::to_string(resolution)), colors.size(), [&] {
+            if (resolution < 0) {grid = std::make_unique<AgglomerativeClustering::CoarseningGrid<>>();}
+            else {grid = std::make_unique<AgglomerativeClustering::CoarseningGrid<>>(static_cast<uint16_t>(resolution));}
+            grid->build(colors);
+            histogram = AgglomerativeClustering::AgglomerativeHistogram<>();
+            for (const std::array<uint16_t, 3>& color : colors) {histogram.count(color);}
+        }, [&] {
+            sink = sink + merge_all(*grid, histogram);
+        });
+    }
+
+    run_grid_points<uint8_t, 3>(runner, image, "rgb8");
+    run_grid_points<uint8_t, 4>(runner, image, "rgba8");
+
+}
+
+void run_kdtree(Runner& runner, const Image& image) {
+
+    std::vector<std::array<uint16_t, 3>> colors = distinct_colors(image);
+    size_t pixels = image.width * image.height;
+
+    for (size_t size : {16u, 256u, 4096u}) {
+
+        // An evenly spaced sample of the image's own colours stands in for a palette.
+        std::vector<std::array<uint8_t, 3>> palette;
+        for (size_t i = 0; i < std::min(size, colors.size()); i++) {
+            const std::array<uint16_t, 3>& color = colors[i * colors.size() / std::min(size, colors.size())];
+            palette.push_back({static_cast<uint8_t>(color[0] / 257u), static_cast<uint8_t>(color[1] / 257u), static_cast<uint8_t>(color[2] / 257u)});
+        }
+
+        AgglomerativeClustering::KDTree tree;
+        runner.run("kdtree_build", image, "colors=" + std::to_string(palette.size()), palette.size(), [] {}, [&] {tree.build(palette);});
+
+        runner.run("kdtree_query", image, "colors=" + std::to_string(palette.size()), pixels, [] {}, [&] {
+            uint64_t sum = 0;
+            for (size_t i = 0; i < image.data.size(); i += 4) {sum += tree.get_nearest({image.data[i], image.data[i + 1], image.data[i + 2]})[0];}
+            sink = sink + sum;
+        });
+
+    }
+
+}
+
+void run_end_to_end(Runner& runner, Image& image) {
+
+    size_t pixels = image.width * image.height;
+    int length = static_cast<int>(image.data.size());
+    std::vector<std::pair<std::string, int>> engines = {{"grid", 0}, {"chain", 1}, {"reciprocal", 2}, {"compact", 3}};
+
+    for (const auto& [name, engine] : engines) {
+
+        runner.run("get_clustering", image, "engine=" + name, pixels, [] {}, [&] {
+            uint8_t* output = get_clustering(image.data.data(), length, 0, engine);
+            sink = sink + output[0];
+            std::free(output);
+        });
+
+        runner.run("quantize", image, "engine=" + name + ",k=16", pixels, [] {}, [&] {
+            uint8_t* output = quantize(image.data.data(), length, 0, 16, engine);
+            sink = sink + output[4];
+            std::free(output);
+        });
+
+    }
+
+}
+
+std::vector<std::string> split(const std::string& list) {
+    std::vector<std::string> items;
+    size_t start = 0;
+    while (start <= list.size()) {
+        size_t end = std::min(list.find(',', start), list.size());
+        if (end > start) {items.push_back(list.substr(start, end - start));}
+        start = end + 1;
+    }
+    return items;
+}
+
+}
+
+int main(int argc, char** argv) {
+
+    Benchmark::Settings settings;
+
+    for (int i = 1; i < argc; i++) {
+
+        std::string argument = argv[i];
+        std::string value = i + 1 < argc ? argv[i + 1] : "";
+
+        if (argument == "--generators" && !value.empty()) {settings.generators = Benchmark::split(value); i++;}
+        else if (argument == "--sizes" && !value.empty()) {
+            settings.sizes.clear();
+            for (const std::string& size : Benchmark::split(value)) {settings.sizes.push_back(std::stoul(size));}
+            i++;
+        }
+        else if (argument == "--repeat" && !value.empty()) {settings.repeat = std::max<size_t>(1u, std::stoul(value)); i++;}
+        else if (argument == "--threads" && !value.empty()) {settings.threads = std::stoul(value); i++;}
+        else if (argument == "--filter" && !value.empty()) {settings.filter = value; i++;}
+        else {
+            std::fprintf(stderr,
+                "Usage: agglomerative-clustering-benchmark [--generators gradient,noise,photo,graphics] [--sizes 256,512]\n"
+                "                                          [--repeat 3] [--threads n] [--filter name]\n"
+                "\n"
+                "Images are square with the given side. Prints one JSON object per measurement.\n");
+            return argument == "--help" || argument == "-h" ? 0 : 2;
+        }
+
+    }
+
+    set_thread_count(static_cast<int>(settings.threads));
+    size_t threads = AgglomerativeClustering::get_thread_count();
+    Benchmark::Runner runner(settings);
+
+    for (size_t size : settings.sizes) {
+        for (const std::string& generator : settings.generators) {
+            Benchmark::Image image = Benchmark::generate(generator, size, size);
+            Benchmark::run_histograms(runner, image, threads);
+            Benchmark::run_grid(runner, image);
+            Benchmark::run_kdtree(runner, image);
+            Benchmark::run_end_to_end(runner, image);
+        }
+    }
+
+    return 0;
+
+}
@@ -0,0 +1,339 @@
+// Batch command line tool: clusters or quantizes every raw or PPM image of a directory on a pool of threads.
+#include "clustering.h"
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <limits>
+#include <map>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+// Images are read and written in chunks of whole pixels for both formats, so memory stays bounded whatever their size.
+constexpr size_t CHUNK_SIZE = 12u << 20;
+
+struct Options {
+    std::string command;
+    fs::path input;
+    fs::path output;
+    int k = 16;
+    int engine = 0;
+    int raw_format = 0;
+    size_t jobs = 0;
+    size_t threads = 0;
+};
+
+struct Image {
+    fs::path path;
+    int format = 0;
+    std::string header;
+    std::streamoff offset = 0;
+    uint64_t length = 0;
+};
+
+// Returned buffers start with their length as a 4 byte little endian value, followed by the payload.
+class Buffer {
+
+private:
+
+    uint8_t* data = nullptr;
+
+public:
+
+    explicit Buffer(uint8_t* data) : data(data) {}
+    Buffer(const Buffer&) = delete;
+    Buffer& operator=(const Buffer&) = delete;
+
+    ~Buffer() {
+        std::free(this->data);
+    }
+
+    uint32_t size() const {
+        return uint32_t(this->data[0]) | (uint32_t(this->data[1]) << 8) | (uint32_t(this->data[2]) << 16) | (uint32_t(this->data[3]) << 24);
+    }
+
+    uint8_t* payload() const {
+        return this->data + 4;
+    }
+
+};
+
+[[noreturn]] void usage(const std::string& error = "") {
+    if (!error.empty()) {std::fprintf(stderr, "error: %s\n\n", error.c_str());}
+    std::fprintf(stderr,
+        "Usage: agglomerative-clustering <command> [options] <input directory> <output directory>\n"
+        "\n"
+        "Commands:\n"
+        "  cluster      write the clustering of each image as <name>.clustering\n"
+        "  dendrogram   write the indexed dendrogram of each image as <name>.dendrogram\n"
+        "  palette      write the k colour palette of each image as <name>.palette\n"
+        "  quantize     write each image quantized to k colours in its own format\n"
+        "\n"
+        "Inputs are binary PPM (.ppm), raw rgb (.rgb), raw rgba (.rgba) or raw pixels in --format (.raw).\n"
+        "\n"
+        "Options:\n"
+        "  -k <n>                 palette size for palette and quantize (default 16)\n"
+        "  --engine <name>        grid, chain, reciprocal or compact (default grid)\n"
+        "  --format <rgb|rgba>    pixel format of .raw files (default rgba)\n"
+        "  --jobs <n>             images processed at once (default one per hardware thread)\n"
+        "  --threads <n>          threads used within each image (default the hardware threads left per job)\n");
+    std::exit(2);
+}
+
+size_t parse_count(const std::string& value, const std::string& name) {
+    try {
+        size_t end = 0;
+        long count = std::stol(value, &end);
+        if (end == value.size() && count > 0) {return static_cast<size_t>(count);}
+    }
+    catch (const std::exception&) {}
+    usage(name + " must be a positive integer");
+}
+
+Options parse_options(int argc, char** argv) {
+
+    Options options;
+    std::vector<std::string> positional;
+    // parallel is the former name of reciprocal.
+    std::map<std::string, int> engines = {{"grid", 0}, {"chain", 1}, {"reciprocal", 2}, {"compact", 3}, {"parallel", 2}};
+
+    for (int i = 1; i < argc; i++) {
+
+        std::string argument = argv[i];
+        if (argument == "-h" || argument == "--help") {usage();}
+        if (argument.size() < 2 || argument[0] != '-') {positional.push_back(argument); continue;}
+        if (i + 1 >= argc) {usage(argument + " needs a value");}
+        std::string value = argv[++i];
+
+        if (argument == "-k") {options.k = static_cast<int>(std::min<size_t>(parse_count(value, "-k"), 1u << 24));}
+        else if (argument == "--engine") {
+            if (engines.count(value) == 0) {usage("unknown engine " + value);}
+            options.engine = engines[value];
+        }
+        else if (argument == "--format") {
+            if (value != "rgb" && value != "rgba") {usage("unknown format " + value);}
+            options.raw_format = value == "rgb" ? 1 : 0;
+        }
+        else if (argument == "--jobs") {options.jobs = parse_count(value, "--jobs");}
+        else if (argument == "--threads") {options.threads = parse_count(value, "--threads");}
+        else {usage("unknown option " + argument);}
+
+    }
+
+    if (positional.size() != 3) {usage();}
+    options.command = positional[0];
+    options.input = positional[1];
+    options.output = positional[2];
+    if (options.command != "cluster" && options.command != "dendrogram" && options.command != "palette" && options.command != "quantize") {usage("unknown command " + options.command);}
+    return options;
+
+}
+
+// Reads the next whitespace separated token of a PPM header, skipping comments.
+std::string read_token(std::istream& stream) {
+
+    std::string token;
+    int c = stream.get();
+    while (c != EOF && (std::isspace(c) || c == '#')) {
+        if (c == '#') {while (c != EOF && c != '\n') {c = stream.get();}}
+        c = stream.get();
+    }
+
+    while (c != EOF && !std::isspace(c)) {token.push_back(static_cast<char>(c)); c = stream.get();}
+    return token;
+
+}
+
+// Works out the pixel format and where the pixels start. Only binary PPM with 8-bit channels is supported, whose
+// header is kept so quantized images can be written back with it.
+Image open_image(const fs::path& path, int raw_format) {
+
+    Image image;
+    image.path = path;
+    std::string extension = path.extension().string();
+    uint64_t size = fs::file_size(path);
+
+    if (extension == ".ppm") {
+
+        std::ifstream stream(path, std::ios::binary);
+        std::string magic = read_token(stream);
+        std::string width = read_token(stream);
+        std::string height = read_token(stream);
+        std::string maximum = read_token(stream);
+        if (magic != "P6" || maximum != "255" || !stream) {throw std::runtime_error("not a binary PPM with 8-bit channels");}
+
+        image.format = 1;
+        image.offset = stream.tellg();
+        image.length = std::stoull(width) * std::stoull(height) * 3u;
+        image.header = "P6\n" + width + " " + height + "\n255\n";
+        if (static_cast<uint64_t>(image.offset) + image.length > size) {throw std::runtime_error("PPM data is truncated");}
+        return image;
+
+    }
+
+    image.format = extension == ".rgb" ? 1 : (extension == ".rgba" ? 0 : raw_format);
+    image.length = size;
+    return image;
+
+}
+
+// Calls body(chunk, length) for consecutive chunks of the image's pixel data.
+template<typename Body>
+void read_chunks(const Image& image, std::vector<uint8_t>& chunk, Body body) {
+
+    std::ifstream stream(image.path, std::ios::binary);
+    stream.seekg(image.offset);
+
+    for (uint64_t remaining = image.length; remaining > 0;) {
+        size_t length = static_cast<size_t>(std::min<uint64_t>(remaining, chunk.size()));
+        if (!stream.read(reinterpret_cast<char*>(chunk.data()), static_cast<std::streamsize>(length))) {throw std::runtime_error("failed to read image data");}
+        body(chunk.data(), length);
+        remaining -= length;
+    }
+
+}
+
+void write_file(const fs::path& path, const uint8_t* data, size_t length) {
+    std::ofstream stream(path, std::ios::binary);
+    stream.write(reinterpret_cast<const char*>(data), static_cast<std::streamsize>(length));
+    if (!stream) {throw std::runtime_error("failed to write " + path.string());}
+}
+
+// Counts the image through a streaming session, so no more than one chunk of it is ever in memory, then writes the
+// requested output. Quantizing reads the image a second time and maps each chunk in place, through one matcher built for
+// the whole image, before writing it out.
+uint64_t process(const Options& options, const Image& image) {
+
+    uint64_t pixels = image.length / (image.format == 1 ? 3 : 4);
+    std::vector<uint8_t> chunk(CHUNK_SIZE);
+    Session* session = create_session(image.format, options.engine);
+
+    try {
+        read_chunks(image, chunk, [session](uint8_t* data, size_t length) {feed_pixels(session, data, static_cast<int>(length));});
+    }
+    catch (...) {
+        destroy_session(session);
+        throw;
+    }
+
+    fs::path stem = options.output / image.path.stem();
+    if (options.command == "cluster") {
+        Buffer clustering(finalize_clustering(session));
+        destroy_session(session);
+        write_file(stem.string() + ".clustering", clustering.payload(), clustering.size());
+        return pixels;
+    }
+
+    Buffer dendrogram(finalize_dendrogram(session));
+    destroy_session(session);
+    if (options.command == "dendrogram") {
+        write_file(stem.string() + ".dendrogram", dendrogram.payload(), dendrogram.size());
+        return pixels;
+    }
+
+    Buffer palette(get_palette_from_dendrogram(dendrogram.payload(), static_cast<int>(dendrogram.size()), options.k));
+    if (options.command == "palette") {
+        write_file(stem.string() + ".palette", palette.payload(), palette.size());
+        return pixels;
+    }
+
+    fs::path path = options.output / image.path.filename();
+    std::ofstream stream(path, std::ios::binary);
+    stream.write(image.header.data(), static_cast<std::streamsize>(image.header.size()));
+
+    int expected = static_cast<int>(std::min<uint64_t>(pixels, std::numeric_limits<int>::max()));
+    Quantizer* quantizer = create_quantizer(palette.payload(), static_cast<int>(palette.size()), expected);
+
+    try {
+        read_chunks(image, chunk, [&](uint8_t* data, size_t length) {
+            int written = quantize_with_quantizer_into(quantizer, data, static_cast<int>(length), image.format, data);
+            stream.write(reinterpret_cast<const char*>(data), written);
+        });
+    }
+    catch (...) {
+        destroy_quantizer(quantizer);
+        throw;
+    }
+
+    destroy_quantizer(quantizer);
+
+    if (!stream) {throw std::runtime_error("failed to write " + path.string());}
+    return pixels;
+
+}
+
+int main(int argc, char** argv) {
+
+    Options options = parse_options(argc, argv);
+    std::vector<fs::path> paths;
+
+    try {
+        for (const fs::directory_entry& entry : fs::directory_iterator(options.input)) {
+            std::string extension = entry.path().extension().string();
+            if (!entry.is_regular_file()) {continue;}
+            if (extension == ".ppm" || extension == ".rgb" || extension == ".rgba" || extension == ".raw") {paths.push_back(entry.path());}
+        }
+        fs::create_directories(options.output);
+    }
+    catch (const fs::filesystem_error& error) {
+        std::fprintf(stderr, "error: %s\n", error.what());
+        return 1;
+    }
+
+    std::sort(paths.begin(), paths.end());
+    if (paths.empty()) {std::fprintf(stderr, "error: no .ppm, .rgb, .rgba or .raw images in %s\n", options.input.string().c_str()); return 1;}
+
+    // Whole images spread over the pool first, and whatever hardware threads remain go to the work within each image.
+    size_t hardware = std::max(1u, std::thread::hardware_concurrency());
+    size_t jobs = std::min(options.jobs == 0 ? hardware : options.jobs, paths.size());
+    size_t threads = options.threads == 0 ? std::max<size_t>(1u, hardware / jobs) : options.threads;
+    set_thread_count(static_cast<int>(threads));
+
+    std::atomic<size_t> next{0};
+    std::atomic<uint64_t> total_pixels{0};
+    std::atomic<size_t> failures{0};
+    std::mutex output;
+
+    std::printf("image\tpixels\tmilliseconds\tmegapixels_per_second\n");
+    auto start = std::chrono::steady_clock::now();
+
+    auto worker = [&]() {
+        for (size_t i = next++; i < paths.size(); i = next++) {
+
+            auto begin = std::chrono::steady_clock::now();
+            try {
+                uint64_t pixels = process(options, open_image(paths[i], options.raw_format));
+                double milliseconds = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - begin).count();
+                total_pixels += pixels;
+                std::lock_guard<std::mutex> lock(output);
+                std::printf("%s\t%llu\t%.3f\t%.3f\n", paths[i].filename().string().c_str(), static_cast<unsigned long long>(pixels), milliseconds, pixels / std::max(milliseconds, 1e-3) / 1000.0);
+                std::fflush(stdout);
+            }
+            catch (const std::exception& error) {
+                failures++;
+                std::lock_guard<std::mutex> lock(output);
+                std::fprintf(stderr, "%s: %s\n", paths[i].string().c_str(), error.what());
+            }
+
+        }
+    };
+
+    std::vector<std::thread> pool;
+    for (size_t i = 1; i < jobs; i++) {pool.emplace_back(worker);}
+    worker();
+    for (std::thread& thread : pool) {thread.join();}
+
+    double milliseconds = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    std::printf("total\t%llu\t%.3f\t%.3f\n", static_cast<unsigned long long>(total_pixels.load()), milliseconds, total_pixels.load() / std::max(milliseconds, 1e-3) / 1000.0);
+    return failures > 0 ? 1 : 0;
+
+}
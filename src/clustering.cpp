@@ -1,6 +1,20 @@
 // Average Hierarchical Agglomerative Color Clustering
 #include "clustering.hpp"
+#include "clustering.h"
+#include <cstring>
+#include <iterator>
+#include <string>
+
+// Native builds export the same functions as the WASM build through the C API in clustering.h.
+#ifdef __EMSCRIPTEN__
 #include <emscripten.h>
+#else
+#define EMSCRIPTEN_KEEPALIVE
+#endif
+
+#if defined(AGGLOMERATIVE_CLUSTERING_STATS) && !defined(__EMSCRIPTEN__) && (defined(__unix__) || defined(__APPLE__))
+#include <sys/resource.h>
+#endif
 
 inline uint16_t uint8_to_uint16(uint8_t value) {
     return (uint16_t(value) * std::numeric_limits<uint16_t>::max()) / std::numeric_limits<uint8_t>::max();
@@ -10,35 +24,126 @@ inline uint8_t uint16_to_uint8(uint16_t value) {
     return static_cast<uint8_t>((static_cast<uint32_t>(value) * std::numeric_limits<uint8_t>::max() + (std::numeric_limits<uint16_t>::max() / 2)) / std::numeric_limits<uint16_t>::max());
 }
 
-uint8_t* pack_variable_size(std::vector<uint8_t> vector) {
+uint8_t* pack_variable_size(const std::vector<uint8_t>& vector) {
     uint8_t* output = (uint8_t*) std::malloc(4 + vector.size());
     output[0] = (vector.size() >> 0) & 0xFF;
     output[1] = (vector.size() >> 8) & 0xFF;
     output[2] = (vector.size() >> 16) & 0xFF;
     output[3] = (vector.size() >> 24) & 0xFF;
-    std::memcpy(output + 4, vector.data(), vector.size() * sizeof(uint8_t));
+    // An empty vector may have no storage at all, and memcpy from a null pointer is undefined even for no bytes.
+    if (!vector.empty()) {std::memcpy(output + 4, vector.data(), vector.size() * sizeof(uint8_t));}
     return output;
 }
 
-std::vector<uint8_t> _get_clustering(uint8_t* image_data, int image_length, int image_format) {
+inline void write_merge(std::vector<uint8_t>& clustering, size_t index, const std::array<uint16_t, 3>& m, const std::array<uint16_t, 3>& a, const std::array<uint16_t, 3>& b) {
+    size_t offset = 3 + 9 * index;
+    clustering[offset + 0] = uint16_to_uint8(m[0]);
+    clustering[offset + 1] = uint16_to_uint8(m[1]);
+    clustering[offset + 2] = uint16_to_uint8(m[2]);
+    clustering[offset + 3] = uint16_to_uint8(a[0]);
+    clustering[offset + 4] = uint16_to_uint8(a[1]);
+    clustering[offset + 5] = uint16_to_uint8(a[2]);
+    clustering[offset + 6] = uint16_to_uint8(b[0]);
+    clustering[offset + 7] = uint16_to_uint8(b[1]);
+    clustering[offset + 8] = uint16_to_uint8(b[2]);
+}
+
+inline void append_uint32(std::vector<uint8_t>& output, uint32_t value) {
+    output.push_back((value >> 0) & 0xFF);
+    output.push_back((value >> 8) & 0xFF);
+    output.push_back((value >> 16) & 0xFF);
+    output.push_back((value >> 24) & 0xFF);
+}
 
-    std::vector<uint8_t> clustering;
-    AgglomerativeClustering::CoarseningGrid grid(8u); // TODO: Figure out which starting resolution works best.
-    AgglomerativeClustering::AgglomerativeHistogram histogram;
+inline uint32_t read_uint32(const uint8_t* input) {
+    return uint32_t(input[0]) | (uint32_t(input[1]) << 8) | (uint32_t(input[2]) << 16) | (uint32_t(input[3]) << 24);
+}
+
+inline std::array<uint16_t, 3> widen(const std::array<uint8_t, 3>& color) {
+    std::array<uint16_t, 3> result = {uint8_to_uint16(color[0]), uint8_to_uint16(color[1]), uint8_to_uint16(color[2])};
+    return result;
+}
 
-    int limit = image_format == 1 ? image_length - 2 : image_length - 3;
-    int increment = image_format == 1 ? 3 : 4;
+// A clustering as a binary tree of clusters. Leaves take the first node ids and every merge, from first to last, adds
+// the next one, so the last node is the root.
+struct Dendrogram {
 
-    for (int i = 0; i < limit; i += increment) {
-        std::array<uint16_t, 3> color = {uint8_to_uint16(image_data[i]), uint8_to_uint16(image_data[i+1]), uint8_to_uint16(image_data[i+2])};
-        if (histogram.count(color)) {grid.add(color);}
+    std::vector<std::array<uint16_t, 3>> colors;
+    std::vector<uint32_t> weights;
+    std::vector<std::array<uint32_t, 2>> children;
+    size_t leaves = 0;
+
+    // The grid engines only know live clusters by their colour, so they find their nodes through it.
+    std::unordered_map<uint64_t, uint32_t> nodes;
+
+    static uint64_t key(const std::array<uint16_t, 3>& color) {
+        return uint64_t(color[0]) | (uint64_t(color[1]) << 16) | (uint64_t(color[2]) << 32);
     }
 
-    size_t clustering_size = 3 + 9 * (histogram.size() - 1);
-    clustering.reserve(clustering_size);
-    clustering.resize(clustering_size);
+    uint32_t add(const std::array<uint16_t, 3>& color, uint32_t weight) {
+        this->colors.push_back(color);
+        this->weights.push_back(weight);
+        this->leaves++;
+        return static_cast<uint32_t>(this->colors.size() - 1);
+    }
+
+    uint32_t merge(uint32_t a, uint32_t b, const std::array<uint16_t, 3>& color) {
+        this->colors.push_back(color);
+        this->weights.push_back(this->weights[a] + this->weights[b]);
+        this->children.push_back({a, b});
+        return static_cast<uint32_t>(this->colors.size() - 1);
+    }
+
+    void add_by_color(const std::array<uint16_t, 3>& color, uint32_t weight) {
+        this->nodes[key(color)] = this->add(color, weight);
+    }
+
+    // A merge can land on the colour of another live cluster, which the grid engines then treat as one. It is recorded as
+    // a further merge at no distance so the tree keeps one node per cluster.
+    void merge_by_color(const std::array<uint16_t, 3>& a, const std::array<uint16_t, 3>& b, const std::array<uint16_t, 3>& m) {
+
+        uint32_t first = this->nodes[key(a)];
+        uint32_t second = this->nodes[key(b)];
+        this->nodes.erase(key(a));
+        this->nodes.erase(key(b));
+
+        uint32_t node = this->merge(first, second, m);
+        auto it = this->nodes.find(key(m));
+        if (it != this->nodes.end()) {node = this->merge(it->second, node, m);}
+        this->nodes[key(m)] = node;
+
+    }
+
+};
+
+// Fills the histogram and the dendrogram leaves with every distinct colour counted in 8 bits, widened to 16 bits, and
+// returns those colours so the grid can be bulk loaded from them.
+std::vector<std::array<uint16_t, 3>> count_colors(const AgglomerativeClustering::PixelHistogram& pixels, AgglomerativeClustering::AgglomerativeHistogram<>& histogram, Dendrogram& dendrogram) {
 
-    for (int i = histogram.size() - 2; i >= 0; i--) {
+    std::vector<std::array<uint16_t, 3>> colors;
+    colors.reserve(pixels.size());
+    histogram.reserve(pixels.size());
+    dendrogram.nodes.reserve(pixels.size());
+
+    for (const auto& [key, count] : pixels) {
+        colors.push_back(widen(AgglomerativeClustering::PixelHistogram::unpack(key)));
+        histogram.count(colors.back(), count);
+        dendrogram.add_by_color(colors.back(), count);
+    }
+
+    return colors;
+
+}
+
+Dendrogram _get_clustering_grid(const AgglomerativeClustering::PixelHistogram& pixels) {
+
+    Dendrogram dendrogram;
+    AgglomerativeClustering::CoarseningGrid<> grid;
+    AgglomerativeClustering::AgglomerativeHistogram<> histogram;
+
+    grid.build(count_colors(pixels, histogram, dendrogram), AgglomerativeClustering::get_thread_count());
+
+    while (histogram.size() > 1) {
 
         std::optional<std::pair<std::array<uint16_t, 3>, std::array<uint16_t, 3>>> result = grid.get_nearest();
         if (!result.has_value()) {break;}
@@ -50,21 +155,148 @@ std::vector<uint8_t> _get_clustering(uint8_t* image_data, int image_length, int
         grid.add(m);
         
         // Add the clustering operation
-        size_t offset = 3 + 9 * i;
-        clustering[offset + 0] = uint16_to_uint8(m[0]);
-        clustering[offset + 1] = uint16_to_uint8(m[1]);
-        clustering[offset + 2] = uint16_to_uint8(m[2]);
-        clustering[offset + 3] = uint16_to_uint8(a[0]);
-        clustering[offset + 4] = uint16_to_uint8(a[1]);
-        clustering[offset + 5] = uint16_to_uint8(a[2]);
-        clustering[offset + 6] = uint16_to_uint8(b[0]);
-        clustering[offset + 7] = uint16_to_uint8(b[1]);
-        clustering[offset + 8] = uint16_to_uint8(b[2]);
+        dendrogram.merge_by_color(a, b, m);
+
+    }
 
+    return dendrogram;
+
+}
+
+// The coarsening grid on 8-bit points, packed into 32-bit keys with half the storage and 32-bit distances. Merged
+// colours round down to whole 8-bit values, so clusters meeting on one colour merge early, trading a little accuracy
+// for speed and memory on images with many colours.
+Dendrogram _get_clustering_compact(const AgglomerativeClustering::PixelHistogram& pixels) {
+
+    Dendrogram dendrogram;
+    AgglomerativeClustering::CoarseningGrid<uint8_t, 3> grid;
+    AgglomerativeClustering::AgglomerativeHistogram<uint8_t, 3> histogram;
+
+    std::vector<std::array<uint8_t, 3>> colors;
+    colors.reserve(pixels.size());
+    histogram.reserve(pixels.size());
+    dendrogram.nodes.reserve(pixels.size());
+
+    for (const auto& [key, count] : pixels) {
+        colors.push_back(AgglomerativeClustering::PixelHistogram::unpack(key));
+        histogram.count(colors.back(), count);
+        dendrogram.add_by_color(widen(colors.back()), count);
+    }
+
+    grid.build(colors, AgglomerativeClustering::get_thread_count());
+
+    while (histogram.size() > 1) {
+
+        std::optional<std::pair<std::array<uint8_t, 3>, std::array<uint8_t, 3>>> result = grid.get_nearest();
+        if (!result.has_value()) {break;}
+
+        auto [a, b] = result.value();
+        std::array<uint8_t, 3> m = histogram.merge(a, b);
+        grid.remove(a);
+        grid.remove(b);
+        grid.add(m);
+        dendrogram.merge_by_color(widen(a), widen(b), widen(m));
+
+    }
+
+    return dendrogram;
+
+}
+
+Dendrogram _get_clustering_chain(const AgglomerativeClustering::PixelHistogram& pixels) {
+
+    Dendrogram dendrogram;
+    AgglomerativeClustering::NearestNeighbourChain chain;
+
+    for (const auto& [key, count] : pixels) {
+        std::array<uint16_t, 3> color = widen(AgglomerativeClustering::PixelHistogram::unpack(key));
+        chain.add(color, count);
+        dendrogram.add(color, count);
+    }
+
+    // Merges come back ordered by height rather than creation, so chain cluster ids are mapped to the nodes they became.
+    std::vector<AgglomerativeClustering::NearestNeighbourChain::Merge> merges = chain.cluster();
+    std::vector<uint32_t> nodes(dendrogram.leaves + merges.size());
+    for (uint32_t i = 0; i < dendrogram.leaves; i++) {nodes[i] = i;}
+
+    for (const AgglomerativeClustering::NearestNeighbourChain::Merge& merge : merges) {
+        nodes[merge.id] = dendrogram.merge(nodes[merge.first], nodes[merge.second], merge.merged);
+    }
+
+    return dendrogram;
+
+}
+
+Dendrogram _get_clustering_reciprocal(const AgglomerativeClustering::PixelHistogram& pixels) {
+
+    Dendrogram dendrogram;
+    AgglomerativeClustering::CoarseningGrid<> grid;
+    AgglomerativeClustering::AgglomerativeHistogram<> histogram;
+
+    size_t threads = AgglomerativeClustering::get_thread_count();
+    grid.build(count_colors(pixels, histogram, dendrogram), threads);
+
+    // Each round merges every reciprocal nearest pair at once. Only when there are none, which happens when the grid
+    // needs coarsening or nearest neighbours tie in a cycle, does a round fall back to the single closest pair. Finding
+    // the pairs may use several threads, but merging them stays serial: every merge edits the shared buckets, links and
+    // bucket heap of the grid, so the gain over the grid engine comes from fewer closest pair searches, not from threads.
+    while (histogram.size() > 1) {
+
+        std::vector<std::pair<std::array<uint16_t, 3>, std::array<uint16_t, 3>>> pairs = grid.get_reciprocal_pairs(threads);
+        if (pairs.empty()) {
+            std::optional<std::pair<std::array<uint16_t, 3>, std::array<uint16_t, 3>>> result = grid.get_nearest();
+            if (!result.has_value()) {break;}
+            pairs.push_back(result.value());
+        }
+
+        for (const auto& [a, b] : pairs) {
+            std::array<uint16_t, 3> m = histogram.merge(a, b);
+            grid.remove(a);
+            grid.remove(b);
+            grid.add(m);
+            dendrogram.merge_by_color(a, b, m);
+        }
+
+    }
+
+    return dendrogram;
+
+}
+
+// Engine 0 is the coarsening grid, engine 1 the nearest neighbour chain, engine 2 the coarsening grid merging rounds of
+// reciprocal nearest pairs and engine 3 the coarsening grid on 8-bit points.
+Dendrogram _get_clustering(const AgglomerativeClustering::PixelHistogram& pixels, int engine) {
+    AGGLOMERATIVE_CLUSTERING_TIME(clustering_nanoseconds);
+    AGGLOMERATIVE_CLUSTERING_COUNT(distinct_colors, pixels.size());
+    if (engine == 1) {return _get_clustering_chain(pixels);}
+    if (engine == 2) {return _get_clustering_reciprocal(pixels);}
+    if (engine == 3) {return _get_clustering_compact(pixels);}
+    return _get_clustering_grid(pixels);
+}
+
+Dendrogram _get_clustering(uint8_t* image_data, int image_length, int image_format, int engine) {
+    AgglomerativeClustering::PixelHistogram pixels;
+    pixels.count(image_data, image_length, image_format, AgglomerativeClustering::get_thread_count());
+    return _get_clustering(pixels, engine);
+}
+
+// Writes the colour merge format: the k=1 colour followed by every merge as its merged colour and the two colours it
+// merged, last merge first.
+std::vector<uint8_t> serialize_clustering(const Dendrogram& dendrogram) {
+
+    std::vector<uint8_t> clustering;
+    if (dendrogram.colors.empty()) {return clustering;}
+
+    size_t merges = dendrogram.children.size();
+    clustering.resize(3 + 9 * merges);
+
+    for (size_t i = 0; i < merges; i++) {
+        auto [a, b] = dendrogram.children[i];
+        write_merge(clustering, merges - 1 - i, dendrogram.colors[dendrogram.leaves + i], dendrogram.colors[a], dendrogram.colors[b]);
     }
 
     // Add the k=1 clustering colour
-    std::array<uint16_t, 3> last = histogram.last();
+    std::array<uint16_t, 3> last = dendrogram.colors.back();
     clustering[0] = uint16_to_uint8(last[0]);
     clustering[1] = uint16_to_uint8(last[1]);
     clustering[2] = uint16_to_uint8(last[2]);
@@ -72,10 +304,170 @@ std::vector<uint8_t> _get_clustering(uint8_t* image_data, int image_length, int
 
 }
 
-std::vector<uint8_t> _get_palette_from_clustering(std::vector<uint8_t> clustering, int k) {
+// Writes the indexed dendrogram format, 16 bytes per node: the 8-bit colour and a zero byte, then the pixel count and
+// the indices of both children as little endian 32-bit values, children 0 marking a leaf. The root comes first and
+// undoing the j-th last merge splits a node into nodes 2j + 1 and 2j + 2, so the clusters for any k are exactly the
+// nodes below 2k - 1 whose children are not.
+std::vector<uint8_t> serialize_dendrogram(const Dendrogram& dendrogram) {
+
+    std::vector<uint8_t> output;
+    if (dendrogram.colors.empty()) {return output;}
+
+    size_t merges = dendrogram.children.size();
+    std::vector<uint32_t> positions(dendrogram.colors.size());
+    std::vector<uint32_t> order(2 * merges + 1);
+    order[0] = static_cast<uint32_t>(dendrogram.colors.size() - 1);
+    positions[order[0]] = 0;
+
+    for (size_t j = 0; j < merges; j++) {
+        auto [a, b] = dendrogram.children[merges - 1 - j];
+        order[2 * j + 1] = a;
+        order[2 * j + 2] = b;
+        positions[a] = static_cast<uint32_t>(2 * j + 1);
+        positions[b] = static_cast<uint32_t>(2 * j + 2);
+    }
+
+    output.reserve(16 * order.size());
+    for (uint32_t node : order) {
+        const std::array<uint16_t, 3>& color = dendrogram.colors[node];
+        output.push_back(uint16_to_uint8(color[0]));
+        output.push_back(uint16_to_uint8(color[1]));
+        output.push_back(uint16_to_uint8(color[2]));
+        output.push_back(0);
+        append_uint32(output, dendrogram.weights[node]);
+        bool leaf = node < dendrogram.leaves;
+        append_uint32(output, leaf ? 0 : positions[dendrogram.children[node - dendrogram.leaves][0]]);
+        append_uint32(output, leaf ? 0 : positions[dendrogram.children[node - dendrogram.leaves][1]]);
+    }
+
+    return output;
+
+}
+
+// Describes the error an approximate clustering introduced. Sampling is reported by how many pixels it kept, binning by
+// the mean squared distance, in 8-bit units, that it moved each counted pixel.
+struct Approximation {
+    uint32_t sampled_pixels = 0;
+    uint32_t total_pixels = 0;
+    uint32_t distinct_colors = 0;
+    uint32_t reduced_colors = 0;
+    uint32_t bits = 8;
+    float mean_squared_error = 0.0f;
+};
+
+// Keeps one pixel out of every step, either the first of each run or, to avoid aliasing with regular patterns, one picked
+// from it by a fixed seed pseudo random generator so results stay reproducible.
+std::vector<uint8_t> sample_pixels(const uint8_t* image_data, int image_length, int image_format, uint32_t step, bool random) {
+
+    size_t stride = image_format == 1 ? 3 : 4;
+    size_t pixels = image_length / stride;
+    std::vector<uint8_t> sampled;
+    sampled.reserve((pixels + step - 1) / step * stride);
+
+    uint32_t state = 0x9e3779b9u;
+    for (size_t start = 0; start < pixels; start += step) {
+        size_t pixel = start;
+        if (random) {
+            state ^= state << 13;
+            state ^= state >> 17;
+            state ^= state << 5;
+            pixel = std::min(pixels - 1, start + state % step);
+        }
+        sampled.insert(sampled.end(), image_data + pixel * stride, image_data + (pixel + 1) * stride);
+    }
+
+    return sampled;
+
+}
+
+// Clusters a subsample of the pixels with their colours binned to the given bits per channel. With max_colors set, the
+// bit depth keeps dropping until at most that many colours remain, which bounds the work handed to the engine.
+Dendrogram _get_clustering_approximate(uint8_t* image_data, int image_length, int image_format, int engine, uint32_t step, bool random, uint32_t bits, uint32_t max_colors, Approximation& approximation) {
+
+    size_t stride = image_format == 1 ? 3 : 4;
+    size_t threads = AgglomerativeClustering::get_thread_count();
+    step = std::max(step, 1u);
+    bits = std::clamp(bits, 1u, 8u);
+
+    AgglomerativeClustering::PixelHistogram pixels;
+    approximation.total_pixels = static_cast<uint32_t>(image_length / stride);
+    approximation.sampled_pixels = approximation.total_pixels;
+
+    if (step == 1) {pixels.count(image_data, image_length, image_format, threads);}
+    else {
+        std::vector<uint8_t> sampled = sample_pixels(image_data, image_length, image_format, step, random);
+        pixels.count(sampled.data(), sampled.size(), image_format, threads);
+        approximation.sampled_pixels = static_cast<uint32_t>(sampled.size() / stride);
+    }
+
+    AgglomerativeClustering::PixelHistogram reduced = pixels;
+    double error = reduced.reduce(bits);
+    while (max_colors > 0 && reduced.size() > max_colors && bits > 1) {
+        reduced = pixels;
+        error = reduced.reduce(--bits);
+    }
+
+    approximation.distinct_colors = static_cast<uint32_t>(pixels.size());
+    approximation.reduced_colors = static_cast<uint32_t>(reduced.size());
+    approximation.bits = bits;
+    approximation.mean_squared_error = static_cast<float>(error);
+    return _get_clustering(reduced, engine);
+
+}
+
+// Prefixes an output with its approximation as six little endian 32-bit fields, the last of them a float.
+std::vector<uint8_t> prefix_approximation(const Approximation& approximation, const std::vector<uint8_t>& output) {
+
+    uint32_t error;
+    std::memcpy(&error, &approximation.mean_squared_error, sizeof(error));
+    std::array<uint32_t, 6> fields = {approximation.sampled_pixels, approximation.total_pixels, approximation.distinct_colors, approximation.reduced_colors, approximation.bits, error};
+
+    std::vector<uint8_t> result;
+    result.reserve(4 * fields.size() + output.size());
+    for (uint32_t field : fields) {append_uint32(result, field);}
+    result.insert(result.end(), output.begin(), output.end());
+    return result;
+
+}
+
+// Accumulates the colours of an image fed in chunks of any size, so it never has to be in memory all at once. Bytes of
+// a pixel split across two chunks wait in partial until the rest of the pixel arrives.
+struct Session {
+    int image_format = 0;
+    int engine = 0;
+    AgglomerativeClustering::PixelHistogram pixels;
+    std::array<uint8_t, 4> partial{};
+    size_t partial_length = 0;
+};
+
+void _feed_pixels(Session& session, const uint8_t* chunk, size_t chunk_length) {
+
+    size_t stride = session.image_format == 1 ? 3 : 4;
+    size_t threads = AgglomerativeClustering::get_thread_count();
+
+    if (session.partial_length > 0) {
+        size_t needed = std::min(stride - session.partial_length, chunk_length);
+        std::copy(chunk, chunk + needed, session.partial.begin() + session.partial_length);
+        session.partial_length += needed;
+        chunk += needed;
+        chunk_length -= needed;
+        if (session.partial_length < stride) {return;}
+        session.pixels.add(session.partial.data(), stride, session.image_format, threads);
+        session.partial_length = 0;
+    }
+
+    size_t whole = chunk_length / stride * stride;
+    session.pixels.add(chunk, whole, session.image_format, threads);
+    session.partial_length = chunk_length - whole;
+    std::copy(chunk + whole, chunk + chunk_length, session.partial.begin());
+
+}
+
+// Reads the clustering in place, so callers can pass memory they do not own without copying it first.
+std::vector<uint8_t> _get_palette_from_clustering(const uint8_t* clustering, size_t clustering_length, int k) {
 
     std::vector<uint8_t> palette;
-    if (clustering.size() < 3 || k < 1) {return palette;}
+    if (clustering_length < 3 || k < 1) {return palette;}
 
     struct ArrayHash {
         std::size_t operator()(const std::array<uint8_t, 3>& arr) const noexcept {
@@ -85,7 +477,7 @@ std::vector<uint8_t> _get_palette_from_clustering(std::vector<uint8_t> clusterin
         }
     };
 
-    int merges = (clustering.size() - 3) / 9;
+    int merges = (clustering_length - 3) / 9;
     k = std::min(k - 1, merges);
     std::unordered_set<std::array<uint8_t, 3>, ArrayHash> colors;
     colors.insert({clustering[0], clustering[1], clustering[2]});
@@ -107,87 +499,664 @@ std::vector<uint8_t> _get_palette_from_clustering(std::vector<uint8_t> clusterin
 
 }
 
-std::vector<uint8_t> _quantize(uint8_t* image_data, int image_length, int image_format, std::vector<uint8_t> palette) {
-    
+// Slices the palette for k straight out of an indexed dendrogram: of the top 2k - 1 nodes, those not split further.
+std::vector<uint8_t> _get_palette_from_dendrogram(const uint8_t* dendrogram, size_t dendrogram_length, int k) {
+
+    std::vector<uint8_t> palette;
+    size_t nodes = dendrogram_length / 16;
+    if (nodes == 0 || k < 1) {return palette;}
+
+    size_t top = std::min(2 * static_cast<size_t>(k) - 1, nodes);
+    palette.reserve(3 * (top / 2 + 1));
+
+    for (size_t i = 0; i < top; i++) {
+        const uint8_t* node = dendrogram + 16 * i;
+        uint32_t left = read_uint32(node + 8);
+        if (left != 0 && left < top) {continue;}
+        palette.push_back(node[0]);
+        palette.push_back(node[1]);
+        palette.push_back(node[2]);
+    }
+
+    return palette;
+
+}
+
+// Concatenates the palettes for every k, each preceded by its colour count as a little endian 32-bit value.
+std::vector<uint8_t> _get_palettes_from_dendrogram(const uint8_t* dendrogram, size_t dendrogram_length, const int* ks, size_t count) {
+
+    std::vector<uint8_t> output;
+    for (size_t i = 0; i < count; i++) {
+        std::vector<uint8_t> palette = _get_palette_from_dendrogram(dendrogram, dendrogram_length, ks[i]);
+        append_uint32(output, static_cast<uint32_t>(palette.size() / 3));
+        output.insert(output.end(), palette.begin(), palette.end());
+    }
+
+    return output;
+
+}
+
+std::vector<uint8_t> _get_palette(uint8_t* image_data, int image_length, int image_format, int k, int engine) {
+    std::vector<uint8_t> dendrogram = serialize_dendrogram(_get_clustering(image_data, image_length, image_format, engine));
+    return _get_palette_from_dendrogram(dendrogram.data(), dendrogram.size(), k);
+}
+
+std::vector<std::array<uint8_t, 3>> unpack_palette(const uint8_t* palette, size_t palette_length) {
+
     std::vector<std::array<uint8_t, 3>> colors;
-    colors.reserve(palette.size() / 3);
+    colors.reserve(palette_length / 3);
 
-    for (int i = 0; i < palette.size() - 2; i += 3) {
+    for (size_t i = 0; i + 2 < palette_length; i += 3) {
         std::array<uint8_t, 3> color = {palette[i], palette[i+1], palette[i+2]};
         colors.push_back(color);
     }
 
-    AgglomerativeClustering::KDTree tree;
-    tree.build(colors);
+    return colors;
 
-    std::vector<uint8_t> output;
-    output.reserve(image_length);
+}
+
+// Smallest stripe of pixels worth handing to another thread. Below it waking a worker costs more than mapping the pixels.
+constexpr size_t QUANTIZE_SLICE_PIXELS = 1u << 14;
+
+// Writes every whole pixel of the image to the output and returns the number of bytes written. Each pixel is read before
+// it is written, so the output may be the image itself.
+size_t _quantize_into(const AgglomerativeClustering::PaletteMatcher& matcher, uint8_t* image_data, int image_length, int image_format, uint8_t* output) {
+
+    AGGLOMERATIVE_CLUSTERING_TIME(quantize_nanoseconds);
+    size_t stride = image_format == 1 ? 3 : 4;
+    size_t pixels = image_length / stride;
+    size_t threads = AgglomerativeClustering::get_thread_count();
+    AGGLOMERATIVE_CLUSTERING_COUNT(quantized_pixels, pixels);
+
+    // Every pixel maps independently, so each thread fills its own stripe of the output while sharing the read only matcher.
+    AgglomerativeClustering::parallel_for(pixels, threads, [&](size_t, size_t begin, size_t end) {
+        for (size_t i = begin * stride; i < end * stride; i += stride) {
+            std::array<uint8_t, 3> color = {image_data[i], image_data[i+1], image_data[i+2]};
+            std::array<uint8_t, 3> nearest = matcher.get_nearest(color);
+            output[i+0] = nearest[0];
+            output[i+1] = nearest[1];
+            output[i+2] = nearest[2];
+            if (image_format == 0) {output[i+3] = image_data[i+3];}
+        }
+    }, QUANTIZE_SLICE_PIXELS);
+
+    return pixels * stride;
+
+}
+
+size_t _quantize_into(uint8_t* image_data, int image_length, int image_format, const uint8_t* palette, size_t palette_length, uint8_t* output) {
+    size_t stride = image_format == 1 ? 3 : 4;
+    AgglomerativeClustering::PaletteMatcher matcher;
+    matcher.build(unpack_palette(palette, palette_length), image_length / stride, AgglomerativeClustering::get_thread_count());
+    return _quantize_into(matcher, image_data, image_length, image_format, output);
+}
+
+// A matcher built once for a palette, so an image streamed through in chunks, or a run of images sharing the palette,
+// does not rebuild it per call. It is sized for the pixels expected across all of them.
+struct Quantizer {
+    AgglomerativeClustering::PaletteMatcher matcher;
+};
+
+// Counts a batch of images into one histogram, so a single clustering serves all of them. Each image counts its weight
+// times when weights are given, and images weighing nothing are left out.
+AgglomerativeClustering::PixelHistogram _count_images(uint8_t** image_data, int* image_lengths, int image_count, int image_format, int* image_weights) {
+
+    AgglomerativeClustering::PixelHistogram pixels;
+    size_t threads = AgglomerativeClustering::get_thread_count();
+
+    for (int i = 0; i < image_count; i++) {
+        int weight = image_weights == nullptr ? 1 : image_weights[i];
+        if (weight <= 0 || image_lengths[i] <= 0) {continue;}
+        pixels.add(image_data[i], image_lengths[i], image_format, threads, static_cast<uint32_t>(weight));
+    }
+
+    pixels.flush();
+    return pixels;
+
+}
+
+std::vector<uint8_t> _get_shared_palette(uint8_t** image_data, int* image_lengths, int image_count, int image_format, int* image_weights, int k, int engine) {
+    AgglomerativeClustering::PixelHistogram pixels = _count_images(image_data, image_lengths, image_count, image_format, image_weights);
+    std::vector<uint8_t> dendrogram = serialize_dendrogram(_get_clustering(pixels, engine));
+    return _get_palette_from_dendrogram(dendrogram.data(), dendrogram.size(), k);
+}
+
+std::vector<uint8_t> _quantize(uint8_t* image_data, int image_length, int image_format, const uint8_t* palette, size_t palette_length) {
+    size_t stride = image_format == 1 ? 3 : 4;
+    std::vector<uint8_t> output(image_length / stride * stride);
+    _quantize_into(image_data, image_length, image_format, palette, palette_length, output.data());
+    return output;
+}
 
-    int limit = image_format == 1 ? image_length - 2 : image_length - 3;
-    int increment = image_format == 1 ? 3 : 4;
+// Produces a 2 byte little endian palette size, the palette, one palette index per pixel and, if asked for and the image
+// is rgba, one alpha byte per pixel after all of the indices. Only the first 256 palette colours are used.
+std::vector<uint8_t> _quantize_indexed(uint8_t* image_data, int image_length, int image_format, const uint8_t* palette, size_t palette_length, bool alpha) {
 
-    for (int i = 0; i < limit; i += increment) {
-        std::array<uint8_t, 3> color = {image_data[i], image_data[i+1], image_data[i+2]};
-        std::array<uint8_t, 3> nearest = tree.get_nearest(color);
-        output.push_back(nearest[0]);
-        output.push_back(nearest[1]);
-        output.push_back(nearest[2]);
-        if (image_format == 0) {output.push_back(image_data[i+3]);}
+    AGGLOMERATIVE_CLUSTERING_TIME(quantize_nanoseconds);
+    std::vector<std::array<uint8_t, 3>> colors = unpack_palette(palette, palette_length);
+    if (colors.size() > 256) {colors.resize(256);}
+
+    size_t stride = image_format == 1 ? 3 : 4;
+    size_t pixels = colors.empty() ? 0 : image_length / stride;
+    size_t threads = AgglomerativeClustering::get_thread_count();
+    alpha = alpha && image_format == 0;
+
+    size_t header = 2 + 3 * colors.size();
+    std::vector<uint8_t> output(header + (alpha ? 2 : 1) * pixels);
+    output[0] = (colors.size() >> 0) & 0xFF;
+    output[1] = (colors.size() >> 8) & 0xFF;
+    for (size_t i = 0; i < colors.size(); i++) {
+        output[2 + 3 * i + 0] = colors[i][0];
+        output[2 + 3 * i + 1] = colors[i][1];
+        output[2 + 3 * i + 2] = colors[i][2];
     }
 
+    AgglomerativeClustering::PaletteMatcher matcher;
+    matcher.build(colors, pixels, threads);
+    AGGLOMERATIVE_CLUSTERING_COUNT(quantized_pixels, pixels);
+
+    uint8_t* indices = output.data() + header;
+    uint8_t* alphas = indices + pixels;
+    AgglomerativeClustering::parallel_for(pixels, threads, [&](size_t, size_t begin, size_t end) {
+        for (size_t pixel = begin; pixel < end; pixel++) {
+            const uint8_t* data = image_data + pixel * stride;
+            indices[pixel] = static_cast<uint8_t>(matcher.get_nearest_index({data[0], data[1], data[2]}));
+            if (alpha) {alphas[pixel] = data[3];}
+        }
+    }, QUANTIZE_SLICE_PIXELS);
+
     return output;
 
 }
 
+// The error a palette tracker may also rise by in absolute terms, in squared 8-bit channel units, before the palette is
+// clustered again. Without it a frame the last clustering fit exactly, with a baseline of 0, would be clustered again
+// on any change at all.
+constexpr double TRACKER_ERROR_SLACK = 1.0;
+
+// Follows the palette of a video frame to frame. Every colour of the last frame belongs to one of k clusters keeping the
+// weighted sums of their colours, so a new frame only moves the colours whose counts changed since the last one and the
+// palette is the mean of each cluster. A merge tree cannot be undone colour by colour, so the clusters are seeded from
+// an exact clustering instead, and seeded again whenever too many pixels change or the error drifts too far above the
+// one that clustering reached.
+struct PaletteTracker {
+
+    struct Cluster {
+        std::array<int64_t, 3> sum{};
+        int64_t squares = 0;
+        int64_t weight = 0;
+    };
+
+    int image_format = 0;
+    int k = 0;
+    int engine = 0;
+    double tolerance = 0.0;
+    double max_change = 0.0;
+
+    std::vector<std::pair<uint32_t, uint32_t>> colors;
+    std::unordered_map<uint32_t, uint32_t> assignments;
+    std::vector<Cluster> clusters;
+    double baseline = 0.0;
+
+};
+
+struct TrackerReport {
+    uint32_t recomputed = 0;
+    uint32_t total_pixels = 0;
+    uint32_t changed_pixels = 0;
+    float mean_squared_error = 0.0f;
+    float baseline_error = 0.0f;
+};
+
+void _add_tracked_color(PaletteTracker& tracker, uint32_t cluster, uint32_t key, int64_t count) {
+    std::array<uint8_t, 3> color = AgglomerativeClustering::PixelHistogram::unpack(key);
+    PaletteTracker::Cluster& target = tracker.clusters[cluster];
+    for (size_t c = 0; c < 3; c++) {target.sum[c] += count * color[c];}
+    target.squares += count * (int64_t(color[0]) * color[0] + int64_t(color[1]) * color[1] + int64_t(color[2]) * color[2]);
+    target.weight += count;
+}
+
+// Mean squared distance of every pixel to the mean of its cluster.
+double _get_tracked_error(const PaletteTracker& tracker) {
+
+    double error = 0.0;
+    int64_t pixels = 0;
+    for (const PaletteTracker::Cluster& cluster : tracker.clusters) {
+        if (cluster.weight <= 0) {continue;}
+        double spread = double(cluster.sum[0]) * cluster.sum[0] + double(cluster.sum[1]) * cluster.sum[1] + double(cluster.sum[2]) * cluster.sum[2];
+        error += double(cluster.squares) - spread / double(cluster.weight);
+        pixels += cluster.weight;
+    }
+
+    return pixels == 0 ? 0.0 : std::max(error, 0.0) / double(pixels);
+
+}
+
+std::vector<uint8_t> _get_tracked_palette(const PaletteTracker& tracker) {
+
+    std::vector<uint8_t> palette;
+    palette.reserve(3 * tracker.clusters.size());
+    for (const PaletteTracker::Cluster& cluster : tracker.clusters) {
+        if (cluster.weight <= 0) {continue;}
+        for (size_t c = 0; c < 3; c++) {palette.push_back(static_cast<uint8_t>((cluster.sum[c] + cluster.weight / 2) / cluster.weight));}
+    }
+
+    return palette;
+
+}
+
+// Clusters the frame exactly and assigns each of its colours to the nearest colour of the palette for k.
+void _seed_tracker(PaletteTracker& tracker, const AgglomerativeClustering::PixelHistogram& pixels) {
+
+    std::vector<uint8_t> dendrogram = serialize_dendrogram(_get_clustering(pixels, tracker.engine));
+    std::vector<uint8_t> palette = _get_palette_from_dendrogram(dendrogram.data(), dendrogram.size(), tracker.k);
+    std::vector<std::array<uint8_t, 3>> colors = unpack_palette(palette.data(), palette.size());
+
+    AgglomerativeClustering::PaletteMatcher matcher;
+    matcher.build(colors, tracker.colors.size(), AgglomerativeClustering::get_thread_count());
+    tracker.clusters.assign(colors.size(), PaletteTracker::Cluster());
+    tracker.assignments.clear();
+    tracker.assignments.reserve(tracker.colors.size());
+
+    for (const auto& [key, count] : tracker.colors) {
+        uint32_t cluster = static_cast<uint32_t>(matcher.get_nearest_index(AgglomerativeClustering::PixelHistogram::unpack(key)));
+        tracker.assignments[key] = cluster;
+        _add_tracked_color(tracker, cluster, key, count);
+    }
+
+    // Palette colours no colour of the frame is nearest to would leave empty clusters, which the palette skips, so they
+    // are dropped and the rest renumbered to keep every cluster index the index of its palette colour.
+    std::vector<uint32_t> renumbered(tracker.clusters.size());
+    uint32_t kept = 0;
+    for (size_t i = 0; i < tracker.clusters.size(); i++) {
+        renumbered[i] = kept;
+        if (tracker.clusters[i].weight > 0) {tracker.clusters[kept++] = tracker.clusters[i];}
+    }
+
+    if (kept < tracker.clusters.size()) {
+        tracker.clusters.resize(kept);
+        for (auto& [key, cluster] : tracker.assignments) {cluster = renumbered[cluster];}
+    }
+
+    tracker.baseline = _get_tracked_error(tracker);
+
+}
+
+// Both histograms are sorted by colour, so one walk over them finds every count that changed. New colours join the
+// cluster whose mean is nearest, and colours that disappeared leave the cluster they were in.
+std::vector<uint8_t> _track_frame(PaletteTracker& tracker, uint8_t* image_data, int image_length, TrackerReport& report) {
+
+    AgglomerativeClustering::PixelHistogram pixels;
+    pixels.count(image_data, image_length, tracker.image_format, AgglomerativeClustering::get_thread_count());
+    std::vector<std::pair<uint32_t, uint32_t>> colors(pixels.begin(), pixels.end());
+
+    uint64_t total = 0;
+    uint64_t changed = 0;
+    const std::vector<std::pair<uint32_t, uint32_t>>& previous = tracker.colors;
+    for (size_t i = 0, j = 0; i < previous.size() || j < colors.size();) {
+        bool old_color = i < previous.size() && (j == colors.size() || previous[i].first <= colors[j].first);
+        bool new_color = j < colors.size() && (i == previous.size() || colors[j].first <= previous[i].first);
+        uint32_t before = old_color ? previous[i++].second : 0u;
+        uint32_t after = new_color ? colors[j++].second : 0u;
+        total += after;
+        if (after > before) {changed += after - before;}
+    }
+
+    report.total_pixels = static_cast<uint32_t>(total);
+    report.changed_pixels = static_cast<uint32_t>(changed);
+    bool seed = tracker.clusters.empty() || double(changed) > tracker.max_change * double(total);
+
+    if (!seed) {
+
+        // No cluster is empty between frames, so the palette has one colour per cluster in the same order.
+        std::vector<uint8_t> palette = _get_tracked_palette(tracker);
+        AgglomerativeClustering::PaletteMatcher matcher;
+        matcher.build(unpack_palette(palette.data(), palette.size()), changed, AgglomerativeClustering::get_thread_count());
+
+        for (size_t i = 0, j = 0; i < previous.size() || j < colors.size();) {
+            bool old_color = i < previous.size() && (j == colors.size() || previous[i].first <= colors[j].first);
+            bool new_color = j < colors.size() && (i == previous.size() || colors[j].first <= previous[i].first);
+            uint32_t key = old_color ? previous[i].first : colors[j].first;
+            int64_t before = old_color ? previous[i++].second : 0;
+            int64_t after = new_color ? colors[j++].second : 0;
+            if (before == after) {continue;}
+
+            if (before == 0) {
+                uint32_t cluster = static_cast<uint32_t>(matcher.get_nearest_index(AgglomerativeClustering::PixelHistogram::unpack(key)));
+                tracker.assignments[key] = cluster;
+                _add_tracked_color(tracker, cluster, key, after);
+                continue;
+            }
+
+            auto it = tracker.assignments.find(key);
+            _add_tracked_color(tracker, it->second, key, after - before);
+            if (after == 0) {tracker.assignments.erase(it);}
+        }
+
+        // A cluster losing all of its pixels would drop a palette colour, so that also calls for a fresh clustering.
+        double error = _get_tracked_error(tracker);
+        bool emptied = std::any_of(tracker.clusters.begin(), tracker.clusters.end(), [](const PaletteTracker::Cluster& cluster) {return cluster.weight <= 0;});
+        seed = emptied || error > tracker.baseline * (1.0 + tracker.tolerance) + TRACKER_ERROR_SLACK;
+
+    }
+
+    tracker.colors.swap(colors);
+    if (seed) {_seed_tracker(tracker, pixels);}
+
+    report.recomputed = seed ? 1u : 0u;
+    report.mean_squared_error = static_cast<float>(_get_tracked_error(tracker));
+    report.baseline_error = static_cast<float>(tracker.baseline);
+    return _get_tracked_palette(tracker);
+
+}
+
+std::vector<uint8_t> prefix_tracker_report(const TrackerReport& report, const std::vector<uint8_t>& output) {
+
+    uint32_t error;
+    uint32_t baseline;
+    std::memcpy(&error, &report.mean_squared_error, sizeof(error));
+    std::memcpy(&baseline, &report.baseline_error, sizeof(baseline));
+    std::array<uint32_t, 5> fields = {report.recomputed, report.total_pixels, report.changed_pixels, error, baseline};
+
+    std::vector<uint8_t> result;
+    result.reserve(4 * fields.size() + output.size());
+    for (uint32_t field : fields) {append_uint32(result, field);}
+    result.insert(result.end(), output.begin(), output.end());
+    return result;
+
+}
+
+// The WASM heap only ever grows, so its size is its peak. Native builds ask the system for the peak resident set size.
+uint64_t get_peak_memory() {
+#if defined(__EMSCRIPTEN__)
+    return static_cast<uint64_t>(__builtin_wasm_memory_size(0)) * 65536u;
+#elif defined(AGGLOMERATIVE_CLUSTERING_STATS) && (defined(__unix__) || defined(__APPLE__))
+    rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0) {return 0;}
+#if defined(__APPLE__)
+    return static_cast<uint64_t>(usage.ru_maxrss);
+#else
+    return static_cast<uint64_t>(usage.ru_maxrss) * 1024u;
+#endif
+#else
+    return 0;
+#endif
+}
+
+// Writes the counters as a flat JSON object. Builds without AGGLOMERATIVE_CLUSTERING_STATS only report that.
+std::string _get_stats(bool reset) {
+
+#ifdef AGGLOMERATIVE_CLUSTERING_STATS
+    static constexpr const char* names[] = {"histogramNanoseconds", "histogramPixels", "distinctColors", "clusteringNanoseconds", "gridCoarsenings", "gridCoarsenNanoseconds", "gridRefinements", "gridRefineNanoseconds", "gridBucketScans", "gridCacheOperations", "kdtreeQueries", "kdtreeNodesVisited", "quantizeNanoseconds", "quantizedPixels"};
+    auto counters = AgglomerativeClustering::stats.counters();
+    static_assert(std::size(names) == std::tuple_size_v<decltype(counters)>, "_get_stats: every counter needs a name.");
+
+    std::string json = "{\"enabled\":true";
+    for (size_t i = 0; i < counters.size(); i++) {
+        json += ",\"" + std::string(names[i]) + "\":" + std::to_string(counters[i]->load(std::memory_order_relaxed));
+    }
+    json += ",\"peakMemoryBytes\":" + std::to_string(get_peak_memory()) + "}";
+
+    if (reset) {AgglomerativeClustering::stats.reset();}
+    return json;
+#else
+    (void) reset;
+    return "{\"enabled\":false}";
+#endif
+
+}
+
 extern "C" {
 
 EMSCRIPTEN_KEEPALIVE
-uint8_t* get_clustering(uint8_t* image_data, int image_length, int image_format) {
-    std::vector<uint8_t> clustering = _get_clustering(image_data, image_length, image_format);
+uint8_t* get_clustering(uint8_t* image_data, int image_length, int image_format, int engine) {
+    std::vector<uint8_t> clustering = serialize_clustering(_get_clustering(image_data, image_length, image_format, engine));
     return pack_variable_size(clustering);
 }
 
 EMSCRIPTEN_KEEPALIVE
-uint8_t* get_palette(uint8_t* image_data, int image_length, int image_format, int k) {
-    std::vector<uint8_t> clustering = _get_clustering(image_data, image_length, image_format);
-    std::vector<uint8_t> palette = _get_palette_from_clustering(clustering, k);
+uint8_t* get_palette(uint8_t* image_data, int image_length, int image_format, int k, int engine) {
+    std::vector<uint8_t> palette = _get_palette(image_data, image_length, image_format, k, engine);
     return pack_variable_size(palette);
 }
 
 EMSCRIPTEN_KEEPALIVE
 uint8_t* get_palette_from_clustering(uint8_t* clustering_data, int clustering_length, int k) {
-    std::vector<uint8_t> clustering;
-    clustering.resize(clustering_length);
-    std::memcpy(clustering.data(), clustering_data, clustering_length);
-    std::vector<uint8_t> palette = _get_palette_from_clustering(clustering, k);
+    std::vector<uint8_t> palette = _get_palette_from_clustering(clustering_data, clustering_length, k);
+    return pack_variable_size(palette);
+}
+
+// The indexed dendrogram format names the children of every merge by node, so palettes come out of it without
+// replaying merges, and stay distinct clusters even when two of them round to the same 8-bit colour.
+
+EMSCRIPTEN_KEEPALIVE
+uint8_t* get_dendrogram(uint8_t* image_data, int image_length, int image_format, int engine) {
+    std::vector<uint8_t> dendrogram = serialize_dendrogram(_get_clustering(image_data, image_length, image_format, engine));
+    return pack_variable_size(dendrogram);
+}
+
+EMSCRIPTEN_KEEPALIVE
+uint8_t* get_palette_from_dendrogram(uint8_t* dendrogram_data, int dendrogram_length, int k) {
+    std::vector<uint8_t> palette = _get_palette_from_dendrogram(dendrogram_data, dendrogram_length, k);
     return pack_variable_size(palette);
 }
 
 EMSCRIPTEN_KEEPALIVE
-uint8_t* quantize(uint8_t* image_data, int image_length, int image_format, int k) {
-    std::vector<uint8_t> clustering = _get_clustering(image_data, image_length, image_format);
-    std::vector<uint8_t> palette = _get_palette_from_clustering(clustering, k);
-    std::vector<uint8_t> quantized = _quantize(image_data, image_length, image_format, palette);
+uint8_t* get_palettes_from_dendrogram(uint8_t* dendrogram_data, int dendrogram_length, int* ks, int count) {
+    std::vector<uint8_t> palettes = _get_palettes_from_dendrogram(dendrogram_data, dendrogram_length, ks, std::max(count, 0));
+    return pack_variable_size(palettes);
+}
+
+EMSCRIPTEN_KEEPALIVE
+uint8_t* get_palettes(uint8_t* image_data, int image_length, int image_format, int* ks, int count, int engine) {
+    std::vector<uint8_t> dendrogram = serialize_dendrogram(_get_clustering(image_data, image_length, image_format, engine));
+    std::vector<uint8_t> palettes = _get_palettes_from_dendrogram(dendrogram.data(), dendrogram.size(), ks, std::max(count, 0));
+    return pack_variable_size(palettes);
+}
+
+EMSCRIPTEN_KEEPALIVE
+uint8_t* quantize(uint8_t* image_data, int image_length, int image_format, int k, int engine) {
+    std::vector<uint8_t> palette = _get_palette(image_data, image_length, image_format, k, engine);
+    std::vector<uint8_t> quantized = _quantize(image_data, image_length, image_format, palette.data(), palette.size());
     return pack_variable_size(quantized);
 }
 
 EMSCRIPTEN_KEEPALIVE
 uint8_t* quantize_with_clustering(uint8_t* image_data, int image_length, int image_format, uint8_t* clustering_data, int clustering_length, int k) {
-    std::vector<uint8_t> clustering;
-    clustering.resize(clustering_length);
-    std::memcpy(clustering.data(), clustering_data, clustering_length);
-    std::vector<uint8_t> palette = _get_palette_from_clustering(clustering, k);
-    std::vector<uint8_t> quantized = _quantize(image_data, image_length, image_format, palette);
+    std::vector<uint8_t> palette = _get_palette_from_clustering(clustering_data, clustering_length, k);
+    std::vector<uint8_t> quantized = _quantize(image_data, image_length, image_format, palette.data(), palette.size());
     return pack_variable_size(quantized);
 }
 
 EMSCRIPTEN_KEEPALIVE
 uint8_t* quantize_with_palette(uint8_t* image_data, int image_length, int image_format, uint8_t* palette_data, int palette_length) {
-    std::vector<uint8_t> palette;
-    palette.resize(palette_length);
-    std::memcpy(palette.data(), palette_data, palette_length);
-    std::vector<uint8_t> quantized = _quantize(image_data, image_length, image_format, palette);
+    std::vector<uint8_t> quantized = _quantize(image_data, image_length, image_format, palette_data, palette_length);
     return pack_variable_size(quantized);
 }
 
+EMSCRIPTEN_KEEPALIVE
+uint8_t* quantize_indexed(uint8_t* image_data, int image_length, int image_format, int k, int engine, int alpha) {
+    std::vector<uint8_t> palette = _get_palette(image_data, image_length, image_format, k, engine);
+    std::vector<uint8_t> quantized = _quantize_indexed(image_data, image_length, image_format, palette.data(), palette.size(), alpha != 0);
+    return pack_variable_size(quantized);
+}
+
+EMSCRIPTEN_KEEPALIVE
+uint8_t* quantize_with_clustering_indexed(uint8_t* image_data, int image_length, int image_format, uint8_t* clustering_data, int clustering_length, int k, int alpha) {
+    std::vector<uint8_t> palette = _get_palette_from_clustering(clustering_data, clustering_length, k);
+    std::vector<uint8_t> quantized = _quantize_indexed(image_data, image_length, image_format, palette.data(), palette.size(), alpha != 0);
+    return pack_variable_size(quantized);
+}
+
+EMSCRIPTEN_KEEPALIVE
+uint8_t* quantize_with_palette_indexed(uint8_t* image_data, int image_length, int image_format, uint8_t* palette_data, int palette_length, int alpha) {
+    std::vector<uint8_t> quantized = _quantize_indexed(image_data, image_length, image_format, palette_data, palette_length, alpha != 0);
+    return pack_variable_size(quantized);
+}
+
+// The _into variants write the quantized pixels straight into a caller provided output, which may be the image itself,
+// and return the number of bytes written instead of allocating and packing a copy.
+
+EMSCRIPTEN_KEEPALIVE
+int quantize_into(uint8_t* image_data, int image_length, int image_format, int k, int engine, uint8_t* output_data) {
+    std::vector<uint8_t> palette = _get_palette(image_data, image_length, image_format, k, engine);
+    return static_cast<int>(_quantize_into(image_data, image_length, image_format, palette.data(), palette.size(), output_data));
+}
+
+EMSCRIPTEN_KEEPALIVE
+int quantize_with_clustering_into(uint8_t* image_data, int image_length, int image_format, uint8_t* clustering_data, int clustering_length, int k, uint8_t* output_data) {
+    std::vector<uint8_t> palette = _get_palette_from_clustering(clustering_data, clustering_length, k);
+    return static_cast<int>(_quantize_into(image_data, image_length, image_format, palette.data(), palette.size(), output_data));
+}
+
+EMSCRIPTEN_KEEPALIVE
+int quantize_with_palette_into(uint8_t* image_data, int image_length, int image_format, uint8_t* palette_data, int palette_length, uint8_t* output_data) {
+    return static_cast<int>(_quantize_into(image_data, image_length, image_format, palette_data, palette_length, output_data));
+}
+
+// Quantizers keep the matcher of one palette across calls. pixel_count is the number of pixels expected over every call,
+// which decides how the matcher is built.
+
+EMSCRIPTEN_KEEPALIVE
+Quantizer* create_quantizer(uint8_t* palette_data, int palette_length, int pixel_count) {
+    Quantizer* quantizer = new Quantizer();
+    quantizer->matcher.build(unpack_palette(palette_data, palette_length), static_cast<size_t>(std::max(pixel_count, 0)), AgglomerativeClustering::get_thread_count());
+    return quantizer;
+}
+
+EMSCRIPTEN_KEEPALIVE
+int quantize_with_quantizer_into(Quantizer* quantizer, uint8_t* image_data, int image_length, int image_format, uint8_t* output_data) {
+    return static_cast<int>(_quantize_into(quantizer->matcher, image_data, image_length, image_format, output_data));
+}
+
+EMSCRIPTEN_KEEPALIVE
+void destroy_quantizer(Quantizer* quantizer) {
+    delete quantizer;
+}
+
+// The shared variants cluster a batch of images, such as the frames of an animation or the sprites of a sheet, once
+// for one common palette. Weights may be null to count every image once.
+
+EMSCRIPTEN_KEEPALIVE
+uint8_t* get_shared_palette(uint8_t** image_data, int* image_lengths, int image_count, int image_format, int* image_weights, int k, int engine) {
+    std::vector<uint8_t> palette = _get_shared_palette(image_data, image_lengths, image_count, image_format, image_weights, k, engine);
+    return pack_variable_size(palette);
+}
+
+// Quantizes every image into its output, which may be the image itself, against one matcher built for the whole batch,
+// and returns the shared palette.
+EMSCRIPTEN_KEEPALIVE
+uint8_t* quantize_shared_into(uint8_t** image_data, int* image_lengths, int image_count, int image_format, int* image_weights, int k, int engine, uint8_t** output_data) {
+
+    std::vector<uint8_t> palette = _get_shared_palette(image_data, image_lengths, image_count, image_format, image_weights, k, engine);
+
+    size_t stride = image_format == 1 ? 3 : 4;
+    size_t pixels = 0;
+    for (int i = 0; i < image_count; i++) {pixels += std::max(image_lengths[i], 0) / stride;}
+
+    AgglomerativeClustering::PaletteMatcher matcher;
+    matcher.build(unpack_palette(palette.data(), palette.size()), pixels, AgglomerativeClustering::get_thread_count());
+    for (int i = 0; i < image_count; i++) {
+        if (image_lengths[i] > 0) {_quantize_into(matcher, image_data[i], image_lengths[i], image_format, output_data[i]);}
+    }
+
+    return pack_variable_size(palette);
+
+}
+
+// Streaming sessions count an image chunk by chunk, then cluster it once every chunk has been fed.
+
+EMSCRIPTEN_KEEPALIVE
+Session* create_session(int image_format, int engine) {
+    Session* session = new Session();
+    session->image_format = image_format;
+    session->engine = engine;
+    return session;
+}
+
+EMSCRIPTEN_KEEPALIVE
+void feed_pixels(Session* session, uint8_t* chunk_data, int chunk_length) {
+    _feed_pixels(*session, chunk_data, chunk_length);
+}
+
+EMSCRIPTEN_KEEPALIVE
+uint8_t* finalize_clustering(Session* session) {
+    session->pixels.flush();
+    std::vector<uint8_t> clustering = serialize_clustering(_get_clustering(session->pixels, session->engine));
+    return pack_variable_size(clustering);
+}
+
+EMSCRIPTEN_KEEPALIVE
+uint8_t* finalize_dendrogram(Session* session) {
+    session->pixels.flush();
+    std::vector<uint8_t> dendrogram = serialize_dendrogram(_get_clustering(session->pixels, session->engine));
+    return pack_variable_size(dendrogram);
+}
+
+EMSCRIPTEN_KEEPALIVE
+void destroy_session(Session* session) {
+    delete session;
+}
+
+// Palette trackers keep a palette of k colours across the frames of a video. tolerance is how far, relative to the last
+// exact clustering, the mean squared error may rise before clustering again, on top of TRACKER_ERROR_SLACK, and
+// max_change the fraction of pixels that may change colour from one frame to the next before the palette is clustered
+// again outright.
+
+EMSCRIPTEN_KEEPALIVE
+PaletteTracker* create_palette_tracker(int image_format, int k, int engine, float tolerance, float max_change) {
+    PaletteTracker* tracker = new PaletteTracker();
+    tracker->image_format = image_format;
+    tracker->k = std::max(k, 1);
+    tracker->engine = engine;
+    tracker->tolerance = std::max(tolerance, 0.0f);
+    tracker->max_change = std::max(max_change, 0.0f);
+    return tracker;
+}
+
+// Returns a 20 byte report, whether the palette was clustered again, the frame's pixels, how many of them changed colour,
+// the mean squared error and the error of the last exact clustering, followed by the palette.
+EMSCRIPTEN_KEEPALIVE
+uint8_t* track_palette(PaletteTracker* tracker, uint8_t* image_data, int image_length) {
+    TrackerReport report;
+    std::vector<uint8_t> palette = _track_frame(*tracker, image_data, image_length, report);
+    return pack_variable_size(prefix_tracker_report(report, palette));
+}
+
+EMSCRIPTEN_KEEPALIVE
+void destroy_palette_tracker(PaletteTracker* tracker) {
+    delete tracker;
+}
+
+// The approximate variants subsample pixels every sample_step pixels, bin colours to bits per channel and bound the
+// distinct colours by max_colors when it is positive. Their output starts with the approximation it introduced.
+
+EMSCRIPTEN_KEEPALIVE
+uint8_t* get_clustering_approximate(uint8_t* image_data, int image_length, int image_format, int engine, int sample_step, int sample_random, int bits, int max_colors) {
+    Approximation approximation;
+    std::vector<uint8_t> clustering = serialize_clustering(_get_clustering_approximate(image_data, image_length, image_format, engine, std::max(sample_step, 1), sample_random != 0, std::max(bits, 1), std::max(max_colors, 0), approximation));
+    return pack_variable_size(prefix_approximation(approximation, clustering));
+}
+
+EMSCRIPTEN_KEEPALIVE
+uint8_t* get_palette_approximate(uint8_t* image_data, int image_length, int image_format, int k, int engine, int sample_step, int sample_random, int bits, int max_colors) {
+    Approximation approximation;
+    std::vector<uint8_t> dendrogram = serialize_dendrogram(_get_clustering_approximate(image_data, image_length, image_format, engine, std::max(sample_step, 1), sample_random != 0, std::max(bits, 1), std::max(max_colors, 0), approximation));
+    std::vector<uint8_t> palette = _get_palette_from_dendrogram(dendrogram.data(), dendrogram.size(), k);
+    return pack_variable_size(prefix_approximation(approximation, palette));
+}
+
+EMSCRIPTEN_KEEPALIVE
+void set_thread_count(int threads) {
+    AgglomerativeClustering::thread_limit.store(static_cast<size_t>(std::max(threads, 0)), std::memory_order_relaxed);
+}
+
+// Returns the counters as JSON, resetting them afterwards when reset is non zero.
+
+EMSCRIPTEN_KEEPALIVE
+uint8_t* get_stats(int reset) {
+    std::string json = _get_stats(reset != 0);
+    return pack_variable_size(std::vector<uint8_t>(json.begin(), json.end()));
+}
+
 }
\ No newline at end of file
@@ -0,0 +1,75 @@
+// C API of the native library, the same functions the WASM build exports. Functions returning uint8_t* return a buffer
+// allocated with malloc that starts with its payload length as a 4 byte little endian value. Release it with free.
+// Image formats are 0 for rgba and 1 for rgb, engines 0 for the coarsening grid, 1 for the nearest neighbour chain, 2 for
+// the coarsening grid merging rounds of reciprocal nearest pairs and 3 for the coarsening grid on 8-bit points.
+#ifndef AGGLOMERATIVE_CLUSTERING_H
+#define AGGLOMERATIVE_CLUSTERING_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct Session Session;
+typedef struct PaletteTracker PaletteTracker;
+typedef struct Quantizer Quantizer;
+
+uint8_t* get_clustering(uint8_t* image_data, int image_length, int image_format, int engine);
+uint8_t* get_palette(uint8_t* image_data, int image_length, int image_format, int k, int engine);
+uint8_t* get_palette_from_clustering(uint8_t* clustering_data, int clustering_length, int k);
+
+uint8_t* get_dendrogram(uint8_t* image_data, int image_length, int image_format, int engine);
+uint8_t* get_palette_from_dendrogram(uint8_t* dendrogram_data, int dendrogram_length, int k);
+uint8_t* get_palettes_from_dendrogram(uint8_t* dendrogram_data, int dendrogram_length, int* ks, int count);
+uint8_t* get_palettes(uint8_t* image_data, int image_length, int image_format, int* ks, int count, int engine);
+
+uint8_t* quantize(uint8_t* image_data, int image_length, int image_format, int k, int engine);
+uint8_t* quantize_with_clustering(uint8_t* image_data, int image_length, int image_format, uint8_t* clustering_data, int clustering_length, int k);
+uint8_t* quantize_with_palette(uint8_t* image_data, int image_length, int image_format, uint8_t* palette_data, int palette_length);
+
+uint8_t* quantize_indexed(uint8_t* image_data, int image_length, int image_format, int k, int engine, int alpha);
+uint8_t* quantize_with_clustering_indexed(uint8_t* image_data, int image_length, int image_format, uint8_t* clustering_data, int clustering_length, int k, int alpha);
+uint8_t* quantize_with_palette_indexed(uint8_t* image_data, int image_length, int image_format, uint8_t* palette_data, int palette_length, int alpha);
+
+// Write the quantized pixels into output_data, which may be image_data itself, and return the number of bytes written.
+int quantize_into(uint8_t* image_data, int image_length, int image_format, int k, int engine, uint8_t* output_data);
+int quantize_with_clustering_into(uint8_t* image_data, int image_length, int image_format, uint8_t* clustering_data, int clustering_length, int k, uint8_t* output_data);
+int quantize_with_palette_into(uint8_t* image_data, int image_length, int image_format, uint8_t* palette_data, int palette_length, uint8_t* output_data);
+
+// Build the matcher for a palette once, for pixel_count pixels over all calls, and quantize images or chunks of one
+// image against it as above.
+Quantizer* create_quantizer(uint8_t* palette_data, int palette_length, int pixel_count);
+int quantize_with_quantizer_into(Quantizer* quantizer, uint8_t* image_data, int image_length, int image_format, uint8_t* output_data);
+void destroy_quantizer(Quantizer* quantizer);
+
+// Cluster a batch of images once for one shared palette, each image counting image_weights[i] times, or once when
+// image_weights is null. quantize_shared_into writes every image into output_data[i] and returns the palette.
+uint8_t* get_shared_palette(uint8_t** image_data, int* image_lengths, int image_count, int image_format, int* image_weights, int k, int engine);
+uint8_t* quantize_shared_into(uint8_t** image_data, int* image_lengths, int image_count, int image_format, int* image_weights, int k, int engine, uint8_t** output_data);
+
+Session* create_session(int image_format, int engine);
+void feed_pixels(Session* session, uint8_t* chunk_data, int chunk_length);
+uint8_t* finalize_clustering(Session* session);
+uint8_t* finalize_dendrogram(Session* session);
+void destroy_session(Session* session);
+
+// Follows a palette across video frames, clustering exactly only on the first frame, when more than max_change of the
+// pixels change colour, or when the mean squared error rises above (1 + tolerance) times that of the last exact
+// clustering plus one squared channel unit of slack.
+PaletteTracker* create_palette_tracker(int image_format, int k, int engine, float tolerance, float max_change);
+uint8_t* track_palette(PaletteTracker* tracker, uint8_t* image_data, int image_length);
+void destroy_palette_tracker(PaletteTracker* tracker);
+
+uint8_t* get_clustering_approximate(uint8_t* image_data, int image_length, int image_format, int engine, int sample_step, int sample_random, int bits, int max_colors);
+uint8_t* get_palette_approximate(uint8_t* image_data, int image_length, int image_format, int k, int engine, int sample_step, int sample_random, int bits, int max_colors);
+
+// Caps the threads each call uses, 0 restoring one per hardware thread.
+void set_thread_count(int threads);
+uint8_t* get_stats(int reset);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
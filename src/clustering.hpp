@@ -1,5 +1,5 @@
 #if __cplusplus < 201703L
-#error AgglomerativeClustering requires at least C++17"
+#error AgglomerativeClustering requires at least C++17
 #endif
 
 #ifndef AGGLOMERATIVE_CLUSTERING_HPP
@@ -10,289 +10,1864 @@
 #include <functional>
 #include <stdexcept>
 #include <optional>
+#include <algorithm>
+#include <memory>
 #include <cstdint>
+#include <cstdlib>
 #include <utility>
 #include <limits>
 #include <array>
+#include <vector>
+#include <atomic>
+#include <mutex>
 #include <stack>
-#include <map>
+#include <type_traits>
+
+// WASM builds only get threads when compiled with -pthread, everything else can always spawn them.
+#if !defined(__EMSCRIPTEN__) || defined(__EMSCRIPTEN_PTHREADS__)
+#define AGGLOMERATIVE_CLUSTERING_THREADS 1
+#include <condition_variable>
+#include <thread>
+#include <deque>
+#endif
+
+#ifdef AGGLOMERATIVE_CLUSTERING_STATS
+#include <chrono>
+#endif
+
+#if defined(__wasm_simd128__)
+#include <wasm_simd128.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+// x86 kernels are compiled with target attributes rather than -m flags and picked at run time from what the processor
+// supports, so portable binaries still get SSSE3, SSE4.1 and AVX2.
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__)) && !defined(__EMSCRIPTEN__)
+#define AGGLOMERATIVE_CLUSTERING_X86_DISPATCH 1
+#include <immintrin.h>
+#endif
+
+namespace AgglomerativeClustering {
+
+#ifdef AGGLOMERATIVE_CLUSTERING_X86_DISPATCH
+
+struct CpuFeatures {
+    bool ssse3;
+    bool sse41;
+    bool avx2;
+};
+
+// Detected once, on first use.
+inline const CpuFeatures& get_cpu_features() {
+    static const CpuFeatures features = [] {
+        __builtin_cpu_init();
+        return CpuFeatures{__builtin_cpu_supports("ssse3") != 0, __builtin_cpu_supports("sse4.1") != 0, __builtin_cpu_supports("avx2") != 0};
+    }();
+    return features;
+}
+
+#endif
+
+// Caps the threads each call may use, 0 meaning one per hardware thread. Callers that already run one image per thread
+// set it to 1 so the images do not compete for cores.
+inline std::atomic<size_t> thread_limit{0};
+
+inline size_t get_thread_count() {
+#ifdef AGGLOMERATIVE_CLUSTERING_THREADS
+    size_t threads = std::max<size_t>(1u, std::thread::hardware_concurrency());
+    size_t limit = thread_limit.load(std::memory_order_relaxed);
+    return limit == 0 ? threads : std::min(threads, limit);
+#else
+    return 1u;
+#endif
+}
+
+#ifdef AGGLOMERATIVE_CLUSTERING_THREADS
+
+// Threads kept alive between calls, so parallel_for does not spawn and join a thread per slice every time. A job hands
+// out its slices through an atomic counter and the thread that submitted it claims slices as well, so it only ever waits
+// for slices already running, and nested or concurrent jobs cannot deadlock. Workers start on first use, as many as the
+// widest job has needed, and are joined at exit.
+class ThreadPool {
+
+private:
+
+    struct Job {
+        const std::function<void(size_t)>* body;
+        size_t count;
+        std::atomic<size_t> next{0};
+        std::atomic<size_t> done{0};
+    };
+
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable finished;
+    std::deque<std::shared_ptr<Job>> jobs;
+    std::vector<std::thread> workers;
+    bool stopping = false;
+
+    // The body is only read after a slice has been claimed, so a job that outlives its submitter is never run.
+    void work(Job& job) {
+        for (size_t slice = job.next.fetch_add(1); slice < job.count; slice = job.next.fetch_add(1)) {
+            (*job.body)(slice);
+            if (job.done.fetch_add(1) + 1 == job.count) {std::lock_guard<std::mutex> lock(this->mutex); this->finished.notify_all();}
+        }
+    }
+
+    void serve() {
+
+        std::unique_lock<std::mutex> lock(this->mutex);
+        while (true) {
+
+            this->wake.wait(lock, [this] {return this->stopping || !this->jobs.empty();});
+            if (this->jobs.empty()) {return;}
+
+            std::shared_ptr<Job> job = this->jobs.front();
+            if (job->next.load() >= job->count) {this->jobs.pop_front(); continue;}
+
+            lock.unlock();
+            this->work(*job);
+            lock.lock();
+
+        }
+
+    }
+
+public:
+
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(this->mutex);
+            this->stopping = true;
+        }
+        this->wake.notify_all();
+        for (std::thread& worker : this->workers) {worker.join();}
+    }
+
+    // Calls body(slice) once for every slice in [0, count) and returns when all of them have finished.
+    void run(size_t count, const std::function<void(size_t)>& body) {
+
+        std::shared_ptr<Job> job = std::make_shared<Job>();
+        job->body = &body;
+        job->count = count;
+
+        {
+            std::lock_guard<std::mutex> lock(this->mutex);
+            while (this->workers.size() + 1 < count) {this->workers.emplace_back([this] {this->serve();});}
+            this->jobs.push_back(job);
+        }
+        this->wake.notify_all();
+
+        this->work(*job);
+
+        std::unique_lock<std::mutex> lock(this->mutex);
+        this->finished.wait(lock, [&job] {return job->done.load() == job->count;});
+        auto it = std::find(this->jobs.begin(), this->jobs.end(), job);
+        if (it != this->jobs.end()) {this->jobs.erase(it);}
+
+    }
+
+};
+
+inline ThreadPool& get_thread_pool() {
+    static ThreadPool pool;
+    return pool;
+}
+
+#endif
+
+// Splits [0, count) into one contiguous slice per thread, each of at least grain items, and calls body(slice, begin,
+// end) for each of them on the shared thread pool, the calling thread included. Work too small for a second slice, and
+// builds without thread support, run every slice on the calling thread in turn.
+inline size_t parallel_for(size_t count, size_t threads, const std::function<void(size_t, size_t, size_t)>& body, size_t grain = 1) {
+
+    size_t slices = std::max<size_t>(1u, std::min(threads, (count + grain - 1) / std::max<size_t>(1u, grain)));
+    size_t step = (count + slices - 1) / slices;
+    std::function<void(size_t)> slice = [count, step, &body](size_t index) {
+        body(index, std::min(count, index * step), std::min(count, (index + 1) * step));
+    };
+
+#ifdef AGGLOMERATIVE_CLUSTERING_THREADS
+    if (slices > 1) {get_thread_pool().run(slices, slice); return slices;}
+#endif
+    for (size_t index = 0; index < slices; index++) {slice(index);}
+
+    return slices;
+
+}
+
+// Counters and timers for the hot paths, compiled in only when AGGLOMERATIVE_CLUSTERING_STATS is defined. Without it
+// the macros expand to nothing. They accumulate across calls until reset, and are relaxed atomics because worker
+// threads bump them too.
+#ifdef AGGLOMERATIVE_CLUSTERING_STATS
+
+struct Stats {
+
+    std::atomic<uint64_t> histogram_nanoseconds{0};
+    std::atomic<uint64_t> histogram_pixels{0};
+    std::atomic<uint64_t> distinct_colors{0};
+    std::atomic<uint64_t> clustering_nanoseconds{0};
+    std::atomic<uint64_t> grid_coarsenings{0};
+    std::atomic<uint64_t> grid_coarsen_nanoseconds{0};
+    std::atomic<uint64_t> grid_refinements{0};
+    std::atomic<uint64_t> grid_refine_nanoseconds{0};
+    std::atomic<uint64_t> grid_bucket_scans{0};
+    std::atomic<uint64_t> grid_cache_operations{0};
+    std::atomic<uint64_t> kdtree_queries{0};
+    std::atomic<uint64_t> kdtree_nodes_visited{0};
+    std::atomic<uint64_t> quantize_nanoseconds{0};
+    std::atomic<uint64_t> quantized_pixels{0};
+
+    void reset() {
+        for (std::atomic<uint64_t>* counter : this->counters()) {counter->store(0, std::memory_order_relaxed);}
+    }
+
+    std::array<std::atomic<uint64_t>*, 14> counters() {
+        return {&this->histogram_nanoseconds, &this->histogram_pixels, &this->distinct_colors, &this->clustering_nanoseconds, &this->grid_coarsenings, &this->grid_coarsen_nanoseconds, &this->grid_refinements, &this->grid_refine_nanoseconds, &this->grid_bucket_scans, &this->grid_cache_operations, &this->kdtree_queries, &this->kdtree_nodes_visited, &this->quantize_nanoseconds, &this->quantized_pixels};
+    }
+
+};
+
+inline Stats stats;
+
+class ScopedTimer {
+
+private:
+
+    std::atomic<uint64_t>& target;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+public:
+
+    explicit ScopedTimer(std::atomic<uint64_t>& target) : target(target) {}
+
+    ~ScopedTimer() {
+        auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - this->start);
+        this->target.fetch_add(static_cast<uint64_t>(elapsed.count()), std::memory_order_relaxed);
+    }
+
+};
+
+#define AGGLOMERATIVE_CLUSTERING_COUNT(counter, amount) AgglomerativeClustering::stats.counter.fetch_add(static_cast<uint64_t>(amount), std::memory_order_relaxed)
+#define AGGLOMERATIVE_CLUSTERING_TIME(counter) AgglomerativeClustering::ScopedTimer counter##_timer(AgglomerativeClustering::stats.counter)
+
+#else
+
+#define AGGLOMERATIVE_CLUSTERING_COUNT(counter, amount) ((void) 0)
+#define AGGLOMERATIVE_CLUSTERING_TIME(counter) ((void) 0)
+
+#endif
+
+constexpr size_t get_neighbourhood_size(size_t dimensions) {
+    return dimensions == 0u ? 1u : 3u * get_neighbourhood_size(dimensions - 1u);
+}
+
+// Every offset in {-1, 0, 1}^Dimensions in lexicographic order, the last coordinate varying fastest.
+template<size_t Dimensions>
+constexpr std::array<std::array<int8_t, Dimensions>, get_neighbourhood_size(Dimensions)> get_neighbourhood_offsets() {
+    std::array<std::array<int8_t, Dimensions>, get_neighbourhood_size(Dimensions)> offsets{};
+    for (size_t i = 0; i < offsets.size(); i++) {
+        size_t rest = i;
+        for (size_t d = Dimensions; d > 0; d--) {offsets[i][d - 1] = static_cast<int8_t>(int(rest % 3u) - 1); rest /= 3u;}
+    }
+    return offsets;
+}
+
+// Points are arrays of Dimensions unsigned coordinates, 16-bit RGB by default so merged colours keep their sub 8-bit
+// precision. 8-bit points halve the node storage, pack cell keys into 32 bits and keep squared distances in 32 bits.
+// Four dimensions cluster RGBA with the same code, scanning 81 buckets instead of 27.
+template<typename Coordinate = uint16_t, size_t Dimensions = 3>
+class CoarseningGrid {
+
+    static_assert(std::is_same_v<Coordinate, uint8_t> || std::is_same_v<Coordinate, uint16_t>, "CoarseningGrid: coordinates must be uint8_t or uint16_t.");
+    static_assert(Dimensions >= 1u && Dimensions <= 4u, "CoarseningGrid: points must have between 1 and 4 dimensions.");
+
+public:
+
+    using Point = std::array<Coordinate, Dimensions>;
+    using Distance = std::conditional_t<sizeof(Coordinate) == 1u, uint32_t, uint64_t>;
+
+    static constexpr uint16_t BITS = 8u * sizeof(Coordinate);
+
+private:
+
+    using Key = std::conditional_t<BITS * Dimensions <= 32u, uint32_t, uint64_t>;
+    using Offset = std::array<int8_t, Dimensions>;
+
+    static constexpr uint32_t NONE = std::numeric_limits<uint32_t>::max();
+    static constexpr std::array<Offset, get_neighbourhood_size(Dimensions)> OFFSETS = get_neighbourhood_offsets<Dimensions>();
+
+    static Distance get_distance(const Point& a, const Point& b) {
+        Distance distance = 0;
+        for (size_t i = 0; i < Dimensions; i++) {
+            Distance d = static_cast<Distance>(a[i] > b[i] ? a[i] - b[i] : b[i] - a[i]);
+            distance += d * d;
+        }
+        return distance;
+    }
+
+    // Packs a location into one integer ordered by its coordinates in turn, the last varying fastest.
+    static Key pack(const Point& location) {
+        Key key = 0;
+        for (size_t i = 0; i < Dimensions; i++) {key = static_cast<Key>((static_cast<uint64_t>(key) << BITS) | location[i]);}
+        return key;
+    }
+
+    struct Pair {
+
+        Point a{};
+        Point b{};
+        Distance distance = std::numeric_limits<Distance>::max();
+
+        Pair() = default;
+
+        Pair(const Point& a, const Point& b) : a(a), b(b), distance(get_distance(a, b)) {}
+
+        Pair(const Point& a, const Point& b, Distance distance) : a(a), b(b), distance(distance) {}
+
+        bool operator>=(const Pair& other) const {
+            return distance >= other.distance;
+        }
+
+        bool contains(const Point& point) const {
+            return a == point || b == point;
+        }
+
+    };
+
+    // A point together with a link to its nearest neighbour in the surrounding buckets. Every node also heads an
+    // intrusive list of the nodes that link to it, so removing a point only re-searches the points that pointed at it.
+    struct Node {
+        Point point{};
+        uint32_t nearest = NONE;
+        Distance distance = std::numeric_limits<Distance>::max();
+        uint32_t first_reverse = NONE;
+        uint32_t next_reverse = NONE;
+        uint32_t previous_reverse = NONE;
+    };
+
+    // Unordered set of node indices which stores the first few inline and only spills to the heap for dense buckets.
+    class NodeList {
+
+    private:
+
+        static constexpr uint32_t INLINE_CAPACITY = 6;
+
+        std::array<uint32_t, INLINE_CAPACITY> inline_nodes{};
+        std::vector<uint32_t> heap_nodes;
+        uint32_t count = 0;
+
+    public:
+
+        const uint32_t* begin() const {
+            return this->count <= INLINE_CAPACITY ? this->inline_nodes.data() : this->heap_nodes.data();
+        }
+
+        const uint32_t* end() const {
+            return this->begin() + this->count;
+        }
+
+        size_t size() const {
+            return this->count;
+        }
+
+        void insert(uint32_t node) {
+            if (this->count < INLINE_CAPACITY) {this->inline_nodes[this->count++] = node; return;}
+            if (this->count == INLINE_CAPACITY) {this->heap_nodes.assign(this->inline_nodes.begin(), this->inline_nodes.end());}
+            this->heap_nodes.push_back(node);
+            this->count++;
+        }
+
+        bool erase(uint32_t node) {
+
+            uint32_t* nodes = this->count <= INLINE_CAPACITY ? this->inline_nodes.data() : this->heap_nodes.data();
+            uint32_t index = 0;
+            while (index < this->count && nodes[index] != node) {index++;}
+            if (index == this->count) {return false;}
+
+            nodes[index] = nodes[this->count - 1];
+            this->count--;
+            if (this->count < INLINE_CAPACITY) {return true;}
+            if (this->count == INLINE_CAPACITY) {std::copy(this->heap_nodes.begin(), this->heap_nodes.begin() + INLINE_CAPACITY, this->inline_nodes.begin()); this->heap_nodes.clear();}
+            else {this->heap_nodes.pop_back();}
+            return true;
+
+        }
+
+        void clear() {
+            this->count = 0;
+            std::vector<uint32_t>().swap(this->heap_nodes);
+        }
+
+    };
+
+    struct Bucket {
+        Point location{};
+        NodeList points;
+        Pair best;
+        size_t cache_index = 0;
+    };
+
+    // Maps bucket locations to buckets. Coarse grids use a dense array, fine grids an open addressing hash table whose
+    // empty slots have no bucket, since 8-bit RGBA keys use all 32 bits.
+    class CellIndex {
+
+    private:
+
+        static constexpr size_t DENSE_CELL_LIMIT = 1u << 18;
+
+        struct Slot {
+            Key key = 0;
+            Bucket* bucket = nullptr;
+        };
+
+        size_t side = 0;
+        size_t count = 0;
+        std::vector<Bucket*> dense;
+        std::vector<Slot> slots;
+
+        static size_t hash(Key key) {
+            if constexpr (sizeof(Key) == 4u) {
+                key ^= key >> 16;
+                key *= 0x45d9f3bu;
+                key ^= key >> 16;
+            }
+            else {
+                key ^= key >> 33;
+                key *= 0xff51afd7ed558ccdull;
+                key ^= key >> 33;
+            }
+            return static_cast<size_t>(key);
+        }
+
+        size_t get_dense_index(const Point& location) const {
+            size_t index = 0;
+            for (size_t i = 0; i < Dimensions; i++) {index = index * this->side + location[i];}
+            return index;
+        }
+
+        void rehash(size_t capacity) {
+            std::vector<Slot> old_slots(capacity);
+            old_slots.swap(this->slots);
+            size_t mask = this->slots.size() - 1;
+            for (const Slot& slot : old_slots) {
+                if (slot.bucket == nullptr) {continue;}
+                size_t index = hash(slot.key) & mask;
+                while (this->slots[index].bucket != nullptr) {index = (index + 1) & mask;}
+                this->slots[index] = slot;
+            }
+        }
+
+    public:
+
+        // Sizes the index for locations in [0, side) on each axis, expecting roughly the given number of occupied cells.
+        void configure(size_t side, size_t expected = 0) {
+            this->side = side;
+            this->count = 0;
+            this->slots.clear();
+            this->dense.clear();
+
+            size_t cells = 1;
+            for (size_t i = 0; i < Dimensions && cells <= DENSE_CELL_LIMIT; i++) {cells *= side;}
+            if (cells <= DENSE_CELL_LIMIT) {this->dense.assign(cells, nullptr); return;}
+
+            size_t capacity = 64;
+            while (capacity < expected * 2) {capacity *= 2;}
+            this->slots.assign(capacity, Slot());
+        }
+
+        size_t size() const {
+            return this->count;
+        }
+
+        Bucket* find(const Point& location) const {
+
+            for (size_t i = 0; i < Dimensions; i++) {if (location[i] >= this->side) {return nullptr;}}
+            if (!this->dense.empty()) {return this->dense[this->get_dense_index(location)];}
+
+            Key key = pack(location);
+            size_t mask = this->slots.size() - 1;
+            for (size_t index = hash(key) & mask; this->slots[index].bucket != nullptr; index = (index + 1) & mask) {
+                if (this->slots[index].key == key) {return this->slots[index].bucket;}
+            }
+            return nullptr;
+
+        }
+
+        void insert(const Point& location, Bucket* bucket) {
+
+            this->count++;
+            if (!this->dense.empty()) {this->dense[this->get_dense_index(location)] = bucket; return;}
+            if (this->count * 2 > this->slots.size()) {this->rehash(this->slots.size() * 2);}
+
+            Key key = pack(location);
+            size_t mask = this->slots.size() - 1;
+            size_t index = hash(key) & mask;
+            while (this->slots[index].bucket != nullptr) {index = (index + 1) & mask;}
+            this->slots[index] = Slot{key, bucket};
+
+        }
+
+        void erase(const Point& location) {
+
+            this->count--;
+            if (!this->dense.empty()) {this->dense[this->get_dense_index(location)] = nullptr; return;}
+
+            Key key = pack(location);
+            size_t mask = this->slots.size() - 1;
+            size_t index = hash(key) & mask;
+            while (this->slots[index].bucket == nullptr || this->slots[index].key != key) {index = (index + 1) & mask;}
+
+            // Backward shift deletion keeps probe sequences intact without tombstones.
+            size_t next = (index + 1) & mask;
+            while (this->slots[next].bucket != nullptr) {
+                size_t home = hash(this->slots[next].key) & mask;
+                if (((next - home) & mask) >= ((next - index) & mask)) {
+                    this->slots[index] = this->slots[next];
+                    index = next;
+                }
+                next = (next + 1) & mask;
+            }
+            this->slots[index] = Slot();
+
+        }
+
+    };
+
+    static constexpr size_t SLAB_SIZE = 1024;
+    static constexpr uint16_t DEFAULT_RESOLUTION = 8;
+    static constexpr size_t REFINE_OCCUPANCY = 32;
+    static constexpr size_t RESOLUTION_SAMPLE = 4096;
+    static constexpr double RESOLUTION_NEIGHBOURS = 1.5;
+    static constexpr size_t PARALLEL_SCAN_MIN_BUCKETS = 4096;
+
+    bool automatic = false;
+    uint16_t resolution;
+    uint16_t shift;
+    CellIndex grid;
+    std::vector<std::unique_ptr<Bucket[]>> slabs;
+    std::vector<Bucket*> free_buckets;
+    std::vector<Bucket*> cache; // Indexed binary min-heap on best.distance.
+    std::vector<Node> nodes;
+    std::vector<uint32_t> free_nodes;
+    std::vector<uint32_t> orphans;
+    size_t additions = 0; // Points added since the buckets last changed resolution.
+
+    // Once reciprocal pairs are asked for, every node whose link changes is noted, since only those can form new pairs.
+    // Relinking the whole grid changes every link, so it calls for a full scan instead.
+    bool tracking = false;
+    bool all_touched = true;
+    std::vector<uint32_t> touched;
+
+    uint32_t allocate_node(const Point& point) {
+
+        uint32_t id;
+        if (this->free_nodes.empty()) {id = static_cast<uint32_t>(this->nodes.size()); this->nodes.emplace_back();}
+        else {id = this->free_nodes.back(); this->free_nodes.pop_back(); this->nodes[id] = Node();}
+        this->nodes[id].point = point;
+        return id;
+
+    }
+
+    void release_node(uint32_t id) {
+        this->free_nodes.push_back(id);
+    }
+
+    uint32_t find_node(const Bucket* bucket, const Point& point) const {
+        for (uint32_t id : bucket->points) {if (this->nodes[id].point == point) {return id;}}
+        return NONE;
+    }
+
+    void unlink_nearest(uint32_t id) {
+
+        Node& node = this->nodes[id];
+        if (node.nearest == NONE) {return;}
+
+        if (node.previous_reverse != NONE) {this->nodes[node.previous_reverse].next_reverse = node.next_reverse;}
+        else {this->nodes[node.nearest].first_reverse = node.next_reverse;}
+        if (node.next_reverse != NONE) {this->nodes[node.next_reverse].previous_reverse = node.previous_reverse;}
+
+        node.nearest = NONE;
+        node.distance = std::numeric_limits<Distance>::max();
+        node.next_reverse = NONE;
+        node.previous_reverse = NONE;
+
+    }
+
+    // Pushes a node onto the reverse list of the node it currently links to.
+    void push_reverse(uint32_t id) {
+        Node& node = this->nodes[id];
+        Node& target = this->nodes[node.nearest];
+        node.previous_reverse = NONE;
+        node.next_reverse = target.first_reverse;
+        if (target.first_reverse != NONE) {this->nodes[target.first_reverse].previous_reverse = id;}
+        target.first_reverse = id;
+    }
+
+    void link_nearest(uint32_t id, uint32_t nearest, Distance distance) {
+        this->unlink_nearest(id);
+        this->nodes[id].nearest = nearest;
+        this->nodes[id].distance = distance;
+        this->push_reverse(id);
+        if (this->tracking && !this->all_touched) {this->touched.push_back(id);}
+    }
+
+    Bucket* allocate_bucket(const Point& location) {
+
+        if (this->free_buckets.empty()) {
+            this->slabs.push_back(std::make_unique<Bucket[]>(SLAB_SIZE));
+            Bucket* slab = this->slabs.back().get();
+            for (size_t i = SLAB_SIZE; i > 0; i--) {this->free_buckets.push_back(slab + i - 1);}
+        }
+
+        Bucket* bucket = this->free_buckets.back();
+        this->free_buckets.pop_back();
+        bucket->location = location;
+        bucket->best = Pair();
+        return bucket;
+
+    }
+
+    void release_bucket(Bucket* bucket) {
+        bucket->points.clear();
+        this->free_buckets.push_back(bucket);
+    }
+
+    // Cells are 2^shift wide so that every cell at one resolution is exactly the union of the cells it covers at the next finer one.
+    void set_resolution(uint16_t resolution, size_t expected = 0) {
+        if (resolution > BITS) {throw std::invalid_argument("CoarseningGrid::set_resolution: resolution must be at most the bits per coordinate.");}
+        this->resolution = resolution;
+        this->shift = BITS - resolution;
+        this->grid.configure(size_t(1) << resolution, expected);
+    }
+
+    // Moves a location by a neighbourhood offset, failing when that leaves the grid.
+    bool get_neighbour(const Point& location, const Offset& offset, Point& result) const {
+        int32_t side = int32_t(1) << this->resolution;
+        for (size_t i = 0; i < Dimensions; i++) {
+            int32_t coordinate = int32_t(location[i]) + offset[i];
+            if (coordinate < 0 || coordinate >= side) {return false;}
+            result[i] = static_cast<Coordinate>(coordinate);
+        }
+        return true;
+    }
+
+    size_t get_local_buckets(const Point& location, std::array<Bucket*, OFFSETS.size()>& result) const {
+
+        size_t count = 0;
+        Point neighbour;
+
+        for (const Offset& offset : OFFSETS) {
+            if (!this->get_neighbour(location, offset, neighbour)) {continue;}
+            Bucket* bucket = this->grid.find(neighbour);
+            if (bucket != nullptr) {result[count++] = bucket;}
+        }
+
+        return count;
+
+    }
+
+    Point get_location(const Point& point) const {
+        Point result;
+        for (size_t i = 0; i < Dimensions; i++) {result[i] = static_cast<Coordinate>(point[i] >> this->shift);}
+        return result;
+    }
+
+    // Finds the nearest neighbour of a point without touching any links, so it may run on several threads at once.
+    std::pair<uint32_t, Distance> find_nearest(uint32_t id) const {
+
+        uint32_t nearest = NONE;
+        Distance nearest_distance = std::numeric_limits<Distance>::max();
+        const Point point = this->nodes[id].point;
+
+        std::array<Bucket*, OFFSETS.size()> buckets;
+        size_t bucket_count = this->get_local_buckets(this->get_location(point), buckets);
+        AGGLOMERATIVE_CLUSTERING_COUNT(grid_bucket_scans, bucket_count);
+        for (size_t i = 0; i < bucket_count; i++) {
+            for (uint32_t other : buckets[i]->points) {
+                if (other == id) {continue;}
+                Distance distance = get_distance(this->nodes[other].point, point);
+                if (distance >= nearest_distance) {continue;}
+                nearest = other;
+                nearest_distance = distance;
+            }
+        }
+
+        return std::make_pair(nearest, nearest_distance);
+
+    }
+
+    void search_nearest(uint32_t id) {
+        auto [nearest, distance] = this->find_nearest(id);
+        if (nearest == NONE) {this->unlink_nearest(id);}
+        else {this->link_nearest(id, nearest, distance);}
+    }
+
+    // A bucket's best pair is the closest nearest neighbour link among its points.
+    void refresh_best(Bucket* bucket) {
+        bucket->best = Pair();
+        for (uint32_t id : bucket->points) {
+            const Node& node = this->nodes[id];
+            if (node.distance >= bucket->best.distance) {continue;}
+            bucket->best = Pair(node.point, this->nodes[node.nearest].point, node.distance);
+        }
+    }
+
+    void swap_cache(size_t i, size_t j) {
+        std::swap(this->cache[i], this->cache[j]);
+        this->cache[i]->cache_index = i;
+        this->cache[j]->cache_index = j;
+    }
+
+    void sift_up_cache(size_t index) {
+        while (index > 0) {
+            size_t parent = (index - 1) / 2;
+            if (this->cache[parent]->best.distance <= this->cache[index]->best.distance) {break;}
+            this->swap_cache(index, parent);
+            index = parent;
+        }
+    }
+
+    void sift_down_cache(size_t index) {
+        size_t size = this->cache.size();
+        while (true) {
+            size_t left = 2 * index + 1;
+            size_t right = left + 1;
+            size_t smallest = index;
+            if (left < size && this->cache[left]->best.distance < this->cache[smallest]->best.distance) {smallest = left;}
+            if (right < size && this->cache[right]->best.distance < this->cache[smallest]->best.distance) {smallest = right;}
+            if (smallest == index) {break;}
+            this->swap_cache(index, smallest);
+            index = smallest;
+        }
+    }
+
+    void add_cache(Bucket* bucket) {
+        AGGLOMERATIVE_CLUSTERING_COUNT(grid_cache_operations, 1);
+        bucket->cache_index = this->cache.size();
+        this->cache.push_back(bucket);
+        this->sift_up_cache(bucket->cache_index);
+    }
+
+    void remove_cache(Bucket* bucket) {
+        AGGLOMERATIVE_CLUSTERING_COUNT(grid_cache_operations, 1);
+        Bucket* moved = this->cache.back();
+        this->swap_cache(bucket->cache_index, moved->cache_index);
+        this->cache.pop_back();
+        if (moved != bucket) {this->update_cache(moved);}
+    }
+
+    // Restores the heap order after a bucket's best pair has changed in place.
+    void update_cache(Bucket* bucket) {
+        AGGLOMERATIVE_CLUSTERING_COUNT(grid_cache_operations, 1);
+        this->sift_up_cache(bucket->cache_index);
+        this->sift_down_cache(bucket->cache_index);
+    }
+
+    void update_nearest(uint32_t id, uint32_t other, Distance distance) {
+        Node& node = this->nodes[id];
+        if (distance >= node.distance) {return;}
+        node.nearest = other;
+        node.distance = distance;
+    }
+
+    // Recomputes every nearest neighbour link after the buckets changed resolution, in a single sweep over each bucket
+    // and its forward half neighbourhood. This costs time proportional to the number of occupied cells and their points,
+    // rather than re-adding every point and rescanning all of its neighbours.
+    void relink() {
+
+        this->additions = 0;
+        this->all_touched = true;
+        this->touched.clear();
+
+        for (Bucket* bucket : this->cache) {
+            for (uint32_t id : bucket->points) {
+                Node& node = this->nodes[id];
+                node.nearest = NONE;
+                node.distance = std::numeric_limits<Distance>::max();
+                node.first_reverse = NONE;
+                node.next_reverse = NONE;
+                node.previous_reverse = NONE;
+            }
+        }
+
+        for (Bucket* bucket : this->cache) {
+
+            const uint32_t* ids = bucket->points.begin();
+            size_t count = bucket->points.size();
+            for (size_t i = 0; i < count; i++) {
+                for (size_t j = i + 1; j < count; j++) {
+                    Distance distance = get_distance(this->nodes[ids[i]].point, this->nodes[ids[j]].point);
+                    this->update_nearest(ids[i], ids[j], distance);
+                    this->update_nearest(ids[j], ids[i], distance);
+                }
+            }
+
+            // The offsets after the centre are exactly those whose first non-zero coordinate is positive.
+            Point location;
+            for (size_t i = OFFSETS.size() / 2 + 1; i < OFFSETS.size(); i++) {
+
+                if (!this->get_neighbour(bucket->location, OFFSETS[i], location)) {continue;}
+                Bucket* neighbour = this->grid.find(location);
+                if (neighbour == nullptr) {continue;}
+
+                for (uint32_t a : bucket->points) {
+                    for (uint32_t b : neighbour->points) {
+                        Distance distance = get_distance(this->nodes[a].point, this->nodes[b].point);
+                        this->update_nearest(a, b, distance);
+                        this->update_nearest(b, a, distance);
+                    }
+                }
+
+            }
+
+        }
+
+        for (Bucket* bucket : this->cache) {
+            for (uint32_t id : bucket->points) {
+                if (this->nodes[id].nearest != NONE) {this->push_reverse(id);}
+            }
+        }
+
+        for (Bucket* bucket : this->cache) {this->refresh_best(bucket);}
+        for (size_t i = this->cache.size() / 2; i > 0; i--) {this->sift_down_cache(i - 1);}
+
+    }
+
+    // Drops one resolution level by folding each bucket into its parent cell.
+    void coarsen() {
+
+        AGGLOMERATIVE_CLUSTERING_COUNT(grid_coarsenings, 1);
+        AGGLOMERATIVE_CLUSTERING_TIME(grid_coarsen_nanoseconds);
+
+        std::vector<Bucket*> children;
+        children.swap(this->cache);
+        this->set_resolution(this->resolution - 1u, children.size());
+
+        for (Bucket* child : children) {
+
+            Point location;
+            for (size_t i = 0; i < Dimensions; i++) {location[i] = static_cast<Coordinate>(child->location[i] >> 1);}
+            Bucket* parent = this->grid.find(location);
+
+            if (parent == nullptr) {
+                child->location = location;
+                child->cache_index = this->cache.size();
+                this->grid.insert(location, child);
+                this->cache.push_back(child);
+                continue;
+            }
+
+            for (uint32_t id : child->points) {parent->points.insert(id);}
+            this->release_bucket(child);
+
+        }
+
+        this->relink();
+
+    }
+
+    // Raises the resolution one level by moving each bucket's points into the finer cells it covers, returning the
+    // occupancy of the fullest bucket afterwards. Links are left stale for the caller to recompute.
+    size_t split() {
+
+        std::vector<Bucket*> parents;
+        parents.swap(this->cache);
+        this->set_resolution(this->resolution + 1u, parents.size() * 2);
+        size_t largest = 0;
+
+        for (Bucket* parent : parents) {
+            for (uint32_t id : parent->points) {
+                Point location = this->get_location(this->nodes[id].point);
+                Bucket* child = this->grid.find(location);
+                if (child == nullptr) {
+                    child = this->allocate_bucket(location);
+                    child->cache_index = this->cache.size();
+                    this->grid.insert(location, child);
+                    this->cache.push_back(child);
+                }
+                child->points.insert(id);
+                largest = std::max(largest, child->points.size());
+            }
+            this->release_bucket(parent);
+        }
+
+        return largest;
+
+    }
+
+    // The reverse of coarsen, for when merged points pile up in one bucket and every search around it slows down.
+    // Points left alone by the finer cells cost nothing until the next coarsening, which only happens once no bucket
+    // has a pair, so the two never undo each other straight away. The whole grid moves to the finer level rather than
+    // just the crowded bucket, since neighbourhoods are 3^Dimensions cells of one size: a bucket split on its own would
+    // leave points whose neighbourhood covers cells of two sizes, and neither the searches nor the closest pair the
+    // grid promises would hold any longer. See should_refine for how often this may run.
+    void refine() {
+
+        AGGLOMERATIVE_CLUSTERING_COUNT(grid_refinements, 1);
+        AGGLOMERATIVE_CLUSTERING_TIME(grid_refine_nanoseconds);
+
+        size_t largest = this->split();
+        while (largest > REFINE_OCCUPANCY && this->resolution < BITS) {largest = this->split();}
+        this->relink();
+
+    }
+
+    // A refinement relinks every point, so one crowded bucket could otherwise make each add cost the whole grid. Like
+    // renting skis until the rent adds up to the price, a bucket past REFINE_OCCUPANCY is only split once the points
+    // added since the last change of resolution, each of which scanned around a bucket that full, have cost as much as
+    // relinking all of the points would. Refinements then take at most as long as the crowded scans they end. Each one
+    // also moves at least one level finer and only a coarsening, which needs the grid to run out of pairs, moves back,
+    // so no more than BITS of them can run between two coarsenings.
+    bool should_refine(const Bucket* bucket) const {
+        if (bucket->points.size() <= REFINE_OCCUPANCY || this->resolution >= BITS) {return false;}
+        return this->additions * bucket->points.size() >= this->nodes.size() - this->free_nodes.size();
+    }
+
+    // Picks the finest resolution at which a point expects one or two other points in its neighbourhood, so dense
+    // colour sets start on fine grids with small buckets and sparse ones don't begin by coarsening level after level.
+    // Neighbourhoods are counted on an evenly spaced sample and scaled up, and since coarser neighbourhoods contain
+    // finer ones the count only grows as the resolution drops, which lets a binary search find the level.
+    static uint16_t choose_resolution(const std::vector<Point>& points) {
+
+        if (points.size() < 2) {return DEFAULT_RESOLUTION;}
+
+        size_t step = (points.size() + RESOLUTION_SAMPLE - 1) / RESOLUTION_SAMPLE;
+        std::vector<Point> sample;
+        for (size_t i = 0; i < points.size(); i += step) {sample.push_back(points[i]);}
+        if (sample.size() < 2) {return DEFAULT_RESOLUTION;}
+
+        double scale = double(points.size() - 1) / double(sample.size() - 1);
+        std::vector<Key> keys(sample.size());
+
+        auto get_neighbours = [&](uint16_t resolution) {
+
+            uint16_t shift = BITS - resolution;
+            int32_t side = int32_t(1) << resolution;
+            for (size_t i = 0; i < sample.size(); i++) {
+                Point location;
+                for (size_t d = 0; d < Dimensions; d++) {location[d] = static_cast<Coordinate>(sample[i][d] >> shift);}
+                keys[i] = pack(location);
+            }
+            std::sort(keys.begin(), keys.end());
+
+            // Keys sort by each coordinate in turn, so each row of a neighbourhood along the last axis is one contiguous
+            // range, searched from the offsets that start a row.
+            size_t total = 0;
+            for (const Point& point : sample) {
+                for (size_t i = 0; i < OFFSETS.size(); i += 3) {
+
+                    Point first{};
+                    Point last{};
+                    bool inside = true;
+                    for (size_t d = 0; d + 1 < Dimensions && inside; d++) {
+                        int32_t coordinate = int32_t(point[d] >> shift) + OFFSETS[i][d];
+                        inside = coordinate >= 0 && coordinate < side;
+                        first[d] = last[d] = static_cast<Coordinate>(coordinate);
+                    }
+                    if (!inside) {continue;}
+
+                    int32_t coordinate = point[Dimensions - 1] >> shift;
+                    first[Dimensions - 1] = static_cast<Coordinate>(std::max(coordinate - 1, 0));
+                    last[Dimensions - 1] = static_cast<Coordinate>(std::min(coordinate + 1, side - 1));
+                    auto begin = std::lower_bound(keys.begin(), keys.end(), pack(first));
+                    total += std::upper_bound(begin, keys.end(), pack(last)) - begin;
+
+                }
+            }
+
+            return double(total - sample.size()) / double(sample.size()) * scale;
+
+        };
+
+        uint16_t low = 0;
+        uint16_t high = BITS;
+        while (low < high) {
+            uint16_t middle = (low + high + 1) / 2;
+            if (get_neighbours(middle) >= RESOLUTION_NEIGHBOURS) {low = middle;}
+            else {high = middle - 1u;}
+        }
+        return low;
+
+    }
+
+public:
+
+    // Without a resolution the grid picks one from the points it is built from, and starts at 8 if points are only added.
+    CoarseningGrid() : automatic(true) {
+        this->set_resolution(DEFAULT_RESOLUTION);
+    }
+
+    CoarseningGrid(uint16_t resolution) {
+        this->set_resolution(resolution);
+    }
+
+    // Bulk loads an empty grid from distinct points. Every point searches its own neighbourhood for its nearest
+    // neighbour, which only writes to that point, so the buckets are split over threads before linking serially.
+    void build(const std::vector<Point>& points, size_t threads = 1) {
+
+        if (!this->cache.empty()) {throw std::logic_error("CoarseningGrid::build: method must be called on an empty grid.");}
+        this->set_resolution(this->automatic ? choose_resolution(points) : this->resolution, points.size());
+        this->nodes.reserve(points.size());
+        size_t largest = 0;
+
+        for (const Point& point : points) {
+            Point location = this->get_location(point);
+            Bucket* bucket = this->grid.find(location);
+            if (bucket == nullptr) {
+                bucket = this->allocate_bucket(location);
+                bucket->cache_index = this->cache.size();
+                this->grid.insert(location, bucket);
+                this->cache.push_back(bucket);
+            }
+            bucket->points.insert(this->allocate_node(point));
+            largest = std::max(largest, bucket->points.size());
+        }
+
+        while (largest > REFINE_OCCUPANCY && this->resolution < BITS) {largest = this->split();}
+
+        parallel_for(this->cache.size(), threads, [this](size_t, size_t begin, size_t end) {
+            for (size_t i = begin; i < end; i++) {
+                for (uint32_t id : this->cache[i]->points) {
+                    auto [nearest, distance] = this->find_nearest(id);
+                    this->nodes[id].nearest = nearest;
+                    this->nodes[id].distance = distance;
+                }
+            }
+        });
+
+        for (Bucket* bucket : this->cache) {
+            for (uint32_t id : bucket->points) {
+                if (this->nodes[id].nearest != NONE) {this->push_reverse(id);}
+            }
+        }
+
+        for (Bucket* bucket : this->cache) {this->refresh_best(bucket);}
+        for (size_t i = this->cache.size() / 2; i > 0; i--) {this->sift_down_cache(i - 1);}
+
+    }
+
+    inline void add(Coordinate x, Coordinate y, Coordinate z) {
+        static_assert(Dimensions == 3u, "CoarseningGrid::add: coordinates can only be passed separately for three dimensions.");
+        Point point = {x, y, z};
+        this->add(point);
+    }
+
+    void add(Point point) {
+
+        // If we don't have the required bucket, allocate one.
+        Point location = this->get_location(point);
+        Bucket* target = this->grid.find(location);
+        if (target == nullptr) {
+            target = this->allocate_bucket(location);
+            this->grid.insert(location, target);
+            this->add_cache(target);
+        }
+
+        // If we already have this point, don't add it.
+        else if (this->find_node(target, point) != NONE) {
+            return;
+        }
+
+        uint32_t id = this->allocate_node(point);
+        uint32_t nearest = NONE;
+        Distance nearest_distance = std::numeric_limits<Distance>::max();
+
+        std::array<Bucket*, OFFSETS.size()> buckets;
+        size_t bucket_count = this->get_local_buckets(location, buckets);
+        AGGLOMERATIVE_CLUSTERING_COUNT(grid_bucket_scans, bucket_count);
+        for (size_t i = 0; i < bucket_count; i++) {
+
+            Bucket* bucket = buckets[i];
+            bool recache = false;
+
+            for (uint32_t other : bucket->points) {
+
+                const Point other_point = this->nodes[other].point;
+                Distance distance = get_distance(other_point, point);
+                if (distance < nearest_distance) {nearest = other; nearest_distance = distance;}
+
+                // The new point becomes the nearest neighbour of any point it is closer to.
+                if (distance >= this->nodes[other].distance) {continue;}
+                this->link_nearest(other, id, distance);
+                if (distance >= bucket->best.distance) {continue;}
+                bucket->best = Pair(other_point, point, distance);
+                recache = true;
+
+            }
+
+            if (!recache) {continue;}
+            this->update_cache(bucket);
+
+        }
+
+        // Insert into the bucket, refining the grid instead if that has crowded it for long enough.
+        target->points.insert(id);
+        this->additions++;
+        if (this->should_refine(target)) {this->refine(); return;}
+        if (nearest == NONE) {return;}
+        this->link_nearest(id, nearest, nearest_distance);
+        if (nearest_distance >= target->best.distance) {return;}
+        target->best = Pair(point, this->nodes[nearest].point, nearest_distance);
+        this->update_cache(target);
+        
+    }
+
+    inline void remove(Coordinate x, Coordinate y, Coordinate z) {
+        static_assert(Dimensions == 3u, "CoarseningGrid::remove: coordinates can only be passed separately for three dimensions.");
+        Point point = {x, y, z};
+        this->remove(point);
+    }
+
+    void remove(Point point) {
+
+        // We can't remove a point if there is no bucket for it.
+        Point location = this->get_location(point);
+        Bucket* target = this->grid.find(location);
+        if (target == nullptr) {return;}
+
+        // If the point isn't in the bucket, we can't remove it.
+        uint32_t id = this->find_node(target, point);
+        if (id == NONE) {return;}
+        target->points.erase(id);
+        this->unlink_nearest(id);
+
+        // Detach every point whose nearest neighbour was the removed point.
+        this->orphans.clear();
+        for (uint32_t other = this->nodes[id].first_reverse; other != NONE; other = this->nodes[other].next_reverse) {this->orphans.push_back(other);}
+        for (uint32_t other : this->orphans) {
+            Node& node = this->nodes[other];
+            node.nearest = NONE;
+            node.distance = std::numeric_limits<Distance>::max();
+            node.next_reverse = NONE;
+            node.previous_reverse = NONE;
+        }
+        this->release_node(id);
+
+        // Only the orphaned points need a new nearest neighbour. Every one of them is linked again before any bucket is
+        // refreshed, since a bucket refreshed while it still holds an unlinked orphan would cache too far a best pair.
+        for (uint32_t other : this->orphans) {this->search_nearest(other);}
+
+        // If the bucket is empty return it to the pool, otherwise recache it if its best pair used the removed point.
+        if (target->points.size() == 0) {
+            this->grid.erase(location);
+            this->remove_cache(target);
+            this->release_bucket(target);
+        }
+
+        else if (target->best.contains(point)) {
+            this->refresh_best(target);
+            this->update_cache(target);
+        }
+
+        // Any other bucket whose best pair used the removed point must hold one of the orphans.
+        for (uint32_t other : this->orphans) {
+            Bucket* bucket = this->grid.find(this->get_location(this->nodes[other].point));
+            if (!bucket->best.contains(point)) {continue;}
+            this->refresh_best(bucket);
+            this->update_cache(bucket);
+        }
+
+    }
+    
+    uint16_t get_resolution() const {
+        return this->resolution;
+    }
+
+    [[nodiscard]] std::optional<std::pair<Point, Point>> get_nearest() {
+    
+        if (this->cache.size() == 0) {return std::nullopt;}
+        Pair best = this->cache.front()->best;
+        if (best.distance != std::numeric_limits<Distance>::max()) {return std::make_pair(best.a, best.b);}
+        if (best.distance == std::numeric_limits<Distance>::max() && this->resolution == 0u) {return std::nullopt;}
+
+        this->coarsen();
+        return this->get_nearest();
+
+    }
+
+    // Collects every pair of points that are each other's nearest neighbour, closest first. No point appears in two such
+    // pairs, so a whole batch can be merged in one round. A pair that was not reciprocal at the last call must have had
+    // one of its links change since, so after the first call only the touched nodes and the pairs returned last time
+    // are checked. Full scans only read the grid, so large ones are split over threads, while small ones and touched
+    // lists are checked on the calling thread, where starting threads would cost more than the scan.
+    [[nodiscard]] std::vector<std::pair<Point, Point>> get_reciprocal_pairs(size_t threads) {
+
+        // Each pair is reported by its lower node id, or by whichever node was touched, so the ids are kept to drop repeats.
+        auto reciprocal = [this](uint32_t id, std::vector<std::pair<Pair, uint64_t>>& found) {
+            const Node& node = this->nodes[id];
+            if (node.nearest == NONE || this->nodes[node.nearest].nearest != id) {return;}
+            uint64_t key = (uint64_t(std::min(id, node.nearest)) << 32) | std::max(id, node.nearest);
+            found.emplace_back(Pair(node.point, this->nodes[node.nearest].point, node.distance), key);
+        };
+
+        std::vector<std::pair<Pair, uint64_t>> pairs;
+        if (this->all_touched) {
+
+            size_t workers = this->cache.size() >= PARALLEL_SCAN_MIN_BUCKETS ? threads : 1u;
+            std::vector<std::vector<std::pair<Pair, uint64_t>>> found(std::max<size_t>(1u, std::min(workers, this->cache.size())));
+            size_t slices = parallel_for(this->cache.size(), workers, [this, &found, &reciprocal](size_t slice, size_t begin, size_t end) {
+                for (size_t i = begin; i < end; i++) {
+                    for (uint32_t id : this->cache[i]->points) {
+                        if (this->nodes[id].nearest > id) {reciprocal(id, found[slice]);}
+                    }
+                }
+            });
+            for (size_t slice = 0; slice < slices; slice++) {pairs.insert(pairs.end(), found[slice].begin(), found[slice].end());}
+
+        }
+
+        else {
+            for (uint32_t id : this->touched) {reciprocal(id, pairs);}
+        }
+
+        // Ties are broken by node ids so both kinds of scan return the same batch in the same order.
+        std::sort(pairs.begin(), pairs.end(), [](const auto& a, const auto& b) {return a.first.distance != b.first.distance ? a.first.distance < b.first.distance : a.second < b.second;});
+        pairs.erase(std::unique(pairs.begin(), pairs.end(), [](const auto& a, const auto& b) {return a.second == b.second;}), pairs.end());
+
+        this->tracking = true;
+        this->all_touched = false;
+        this->touched.clear();
+
+        // Pairs the caller does not merge are still reciprocal at the next call, so they are checked again then.
+        std::vector<std::pair<Point, Point>> result;
+        result.reserve(pairs.size());
+        for (const auto& [pair, key] : pairs) {
+            result.emplace_back(pair.a, pair.b);
+            this->touched.push_back(static_cast<uint32_t>(key >> 32));
+        }
+
+        return result;
+
+    }
+
+};
+
+class NearestNeighbourChain {
 
-namespace AgglomerativeClustering {
+public:
 
-class CoarseningGrid {
+    // Clusters are identified by the order they were created in, added points first and then one per merge.
+    struct Merge {
+        std::array<uint16_t, 3> merged{};
+        std::array<uint16_t, 3> a{};
+        std::array<uint16_t, 3> b{};
+        uint64_t height = 0;
+        uint32_t id = 0;
+        uint32_t first = 0;
+        uint32_t second = 0;
+        uint32_t weight = 0;
+    };
 
 private:
 
-    struct ArrayHash {
-        std::size_t operator()(const std::array<uint16_t, 3>& arr) const noexcept {
-            size_t seed = 0;
-            for (auto elem : arr) {seed ^= std::hash<uint16_t>{}(elem) + 0x9e3779b9 + (seed << 6) + (seed >> 2);}
-            return seed;
-        }
+    static constexpr uint32_t NONE = std::numeric_limits<uint32_t>::max();
+
+    struct Cluster {
+        std::array<uint16_t, 3> point{};
+        uint32_t weight = 0;
+        uint64_t height = 0;
+        uint32_t next = NONE;
+        uint32_t previous = NONE;
+        bool active = true;
+        bool chained = false;
     };
 
-    struct Pair {
+    std::vector<Cluster> clusters;
+    std::vector<uint32_t> cells;
+    std::array<uint16_t, 3> origin{};
+    std::array<uint16_t, 3> extent{};
+    std::array<int, 3> sides{};
+    uint16_t shift = 16;
+    size_t active = 0;
+
+    static uint64_t get_distance(const std::array<uint16_t, 3>& a, const std::array<uint16_t, 3>& b) {
+        uint64_t dx = static_cast<uint64_t>(a[0] > b[0] ? a[0] - b[0] : b[0] - a[0]);
+        uint64_t dy = static_cast<uint64_t>(a[1] > b[1] ? a[1] - b[1] : b[1] - a[1]);
+        uint64_t dz = static_cast<uint64_t>(a[2] > b[2] ? a[2] - b[2] : b[2] - a[2]);
+        return dx * dx + dy * dy + dz * dz;
+    }
 
-        std::array<uint16_t, 3> a{};
-        std::array<uint16_t, 3> b{};
-        uint64_t distance = std::numeric_limits<uint64_t>::max();
+    size_t get_cell(int x, int y, int z) const {
+        return (size_t(x) * this->sides[1] + size_t(y)) * this->sides[2] + size_t(z);
+    }
 
-        Pair() = default;
+    std::array<int, 3> get_location(const std::array<uint16_t, 3>& point) const {
+        return {(point[0] - this->origin[0]) >> this->shift, (point[1] - this->origin[1]) >> this->shift, (point[2] - this->origin[2]) >> this->shift};
+    }
 
-        Pair(const std::array<uint16_t, 3>& a, const std::array<uint16_t, 3>& b) : a(a), b(b) {
-            uint64_t dx = static_cast<uint64_t>(a[0] > b[0] ? a[0] - b[0] : b[0] - a[0]);
-            uint64_t dy = static_cast<uint64_t>(a[1] > b[1] ? a[1] - b[1] : b[1] - a[1]);
-            uint64_t dz = static_cast<uint64_t>(a[2] > b[2] ? a[2] - b[2] : b[2] - a[2]);
-            distance = dx * dx + dy * dy + dz * dz;
-        }
+    size_t get_cell(const std::array<uint16_t, 3>& point) const {
+        std::array<int, 3> location = this->get_location(point);
+        return this->get_cell(location[0], location[1], location[2]);
+    }
 
-        bool operator>=(const Pair& other) const {
-            return distance >= other.distance;
-        }
+    void link(uint32_t id) {
+        Cluster& cluster = this->clusters[id];
+        uint32_t& head = this->cells[this->get_cell(cluster.point)];
+        cluster.previous = NONE;
+        cluster.next = head;
+        if (head != NONE) {this->clusters[head].previous = id;}
+        head = id;
+    }
 
-        bool contains(const std::array<uint16_t, 3>& point) const {
-            return a == point || b == point;
+    void unlink(uint32_t id) {
+        Cluster& cluster = this->clusters[id];
+        if (cluster.previous != NONE) {this->clusters[cluster.previous].next = cluster.next;}
+        else {this->cells[this->get_cell(cluster.point)] = cluster.next;}
+        if (cluster.next != NONE) {this->clusters[cluster.next].previous = cluster.previous;}
+    }
+
+    // Rebuckets every active cluster into cells 2^shift wide spanning the bounding box of the input. Merged centroids
+    // never leave that box, so the cell count only depends on how the clusters are spread, not on the full colour space.
+    void set_shift(uint16_t shift) {
+        this->shift = shift;
+        for (size_t i = 0; i < 3; i++) {this->sides[i] = (this->extent[i] >> shift) + 1;}
+        this->cells.assign(size_t(this->sides[0]) * this->sides[1] * this->sides[2], NONE);
+        for (uint32_t id = 0; id < this->clusters.size(); id++) {
+            if (this->clusters[id].active) {this->link(id);}
         }
+    }
 
-    };
+    size_t get_cell_count(uint16_t shift) const {
+        return size_t((this->extent[0] >> shift) + 1) * size_t((this->extent[1] >> shift) + 1) * size_t((this->extent[2] >> shift) + 1);
+    }
 
-    struct Bucket {
+    // Searches outwards in shells of cells around the cluster until no unvisited cell can hold anything closer.
+    std::pair<uint32_t, uint64_t> get_nearest(uint32_t id) const {
 
-        std::array<uint16_t, 3> location{};
-        std::unordered_set<std::array<uint16_t, 3>, ArrayHash> points;
-        Pair best;
+        const std::array<uint16_t, 3>& point = this->clusters[id].point;
+        std::array<int, 3> location = this->get_location(point);
+        int cx = location[0];
+        int cy = location[1];
+        int cz = location[2];
+        int radius = std::max({this->sides[0], this->sides[1], this->sides[2]});
 
-        Bucket(const std::array<uint16_t, 3>& location) : location(location) {}
+        uint32_t nearest = NONE;
+        uint64_t nearest_distance = std::numeric_limits<uint64_t>::max();
 
-    };
+        for (int r = 0; r < radius; r++) {
+
+            if (r > 0) {
+                uint64_t gap = static_cast<uint64_t>(r - 1) << this->shift;
+                if (gap * gap >= nearest_distance) {break;}
+            }
+
+            for (int x = std::max(cx - r, 0); x <= std::min(cx + r, this->sides[0] - 1); x++) {
+                for (int y = std::max(cy - r, 0); y <= std::min(cy + r, this->sides[1] - 1); y++) {
+
+                    // Only the two faces of the shell are visited when this row lies inside it.
+                    bool inside = std::abs(x - cx) < r && std::abs(y - cy) < r;
+                    int step = inside ? 2 * r : 1;
+
+                    for (int z = cz - r; z <= cz + r; z += step) {
+                        if (z < 0 || z >= this->sides[2]) {continue;}
+                        for (uint32_t other = this->cells[this->get_cell(x, y, z)]; other != NONE; other = this->clusters[other].next) {
+                            if (other == id) {continue;}
+                            uint64_t distance = get_distance(point, this->clusters[other].point);
+                            if (distance >= nearest_distance) {continue;}
+                            nearest = other;
+                            nearest_distance = distance;
+                        }
+                    }
 
-    uint16_t resolution;
-    uint16_t grid_size;
-    std::unordered_map<std::array<uint16_t, 3>, Bucket*, ArrayHash> grid;
-    std::map<uint64_t, std::unordered_set<Bucket*>> cache;
-
-    std::vector<Bucket*> get_local_buckets(const std::array<uint16_t, 3>& location) const {
-
-        std::vector<Bucket*> result;
-        result.reserve(27);
-
-        std::array<uint16_t, 3> min = location;
-        if (min[0] > 0u) {min[0]--;}
-        if (min[1] > 0u) {min[1]--;}
-        if (min[2] > 0u) {min[2]--;}
-
-        std::array<uint16_t, 3> max = location;
-        max[0]++;
-        max[1]++;
-        max[2]++;
-
-        for (uint16_t x = min[0]; x <= max[0]; x++) {
-            for (uint16_t y = min[1]; y <= max[1]; y++) {
-                for (uint16_t z = min[2]; z <= max[2]; z++) {
-                    std::array<uint16_t, 3> bucket_position = {x, y, z};
-                    auto it = this->grid.find(bucket_position);
-                    if (it != this->grid.end()) {result.push_back(it->second);}
                 }
             }
+
         }
 
-        return result;
+        return std::make_pair(nearest, nearest_distance);
 
     }
 
-    std::vector<std::array<uint16_t, 3>> get_all_points() const {
-        
-        size_t total_size = 0;
-        std::vector<std::array<uint16_t, 3>> result;
-        for (const auto& pair : this->grid) {total_size += pair.second->points.size();}
-        result.reserve(total_size);
+    uint32_t merge(uint32_t a, uint32_t b, uint64_t distance) {
 
-        for (const auto& pair : this->grid) {result.insert(result.end(), pair.second->points.begin(), pair.second->points.end());}
-        return result;
+        Cluster& first = this->clusters[a];
+        Cluster& second = this->clusters[b];
+        uint32_t merged_count = first.weight + second.weight;
+        double a_ratio = (double) first.weight / (double) merged_count;
+        double b_ratio = (double) second.weight / (double) merged_count;
+
+        // Clamping guards against rounding pushing a centroid outside the bounding box of the cell grid.
+        Cluster merged;
+        for (size_t i = 0; i < 3; i++) {
+            uint16_t value = static_cast<uint16_t>(first.point[i] * a_ratio + second.point[i] * b_ratio);
+            merged.point[i] = std::clamp(value, std::min(first.point[i], second.point[i]), std::max(first.point[i], second.point[i]));
+        }
+        merged.weight = merged_count;
+        merged.height = std::max({distance, first.height, second.height});
+
+        this->unlink(a);
+        this->unlink(b);
+        first.active = false;
+        second.active = false;
+
+        uint32_t id = static_cast<uint32_t>(this->clusters.size());
+        this->clusters.push_back(merged);
+        this->link(id);
+        this->active--;
+        return id;
 
     }
 
-    std::vector<std::array<uint16_t, 3>> get_local_points(std::array<uint16_t, 3> location) const {
+public:
 
-        size_t total_size = 0; 
-        std::vector<Bucket*> buckets = this->get_local_buckets(location);
-        for (Bucket* bucket : buckets) {total_size += bucket->points.size();}
-        
-        std::vector<std::array<uint16_t, 3>> result;
-        result.reserve(total_size);
-        for (Bucket* bucket : buckets) {result.insert(result.end(), bucket->points.begin(), bucket->points.end());}
-        return result;
+    void add(const std::array<uint16_t, 3>& point, uint32_t weight) {
+        Cluster cluster;
+        cluster.point = point;
+        cluster.weight = weight;
+        this->clusters.push_back(cluster);
+        this->active++;
+    }
 
+    size_t size() const {
+        return this->active;
     }
 
-    std::array<uint16_t, 3> get_location(const std::array<uint16_t, 3>& point) const {
-        std::array<uint16_t, 3> result = {static_cast<uint16_t>(point[0] / this->grid_size), static_cast<uint16_t>(point[1] / this->grid_size), static_cast<uint16_t>(point[2] / this->grid_size)};
-        return result;
+    // Merges every cluster with the nearest neighbour chain algorithm, returning the merges ordered from first to last.
+    std::vector<Merge> cluster() {
+
+        std::vector<Merge> merges;
+        if (this->active == 0) {return merges;}
+        merges.reserve(this->active - 1);
+        this->clusters.reserve(2 * this->clusters.size());
+
+        std::array<uint16_t, 3> maximum = this->clusters[0].point;
+        this->origin = this->clusters[0].point;
+        for (const Cluster& cluster : this->clusters) {
+            for (size_t i = 0; i < 3; i++) {
+                this->origin[i] = std::min(this->origin[i], cluster.point[i]);
+                maximum[i] = std::max(maximum[i], cluster.point[i]);
+            }
+        }
+        for (size_t i = 0; i < 3; i++) {this->extent[i] = maximum[i] - this->origin[i];}
+
+        // Start with roughly one cluster per cell.
+        uint16_t shift = 0;
+        while (shift < 16u && this->get_cell_count(shift) > this->active) {shift++;}
+        this->set_shift(shift);
+
+        std::vector<uint32_t> chain;
+        uint32_t next_start = 0;
+
+        while (this->active > 1) {
+
+            if (chain.empty()) {
+                while (!this->clusters[next_start].active) {next_start++;}
+                chain.push_back(next_start);
+                this->clusters[next_start].chained = true;
+            }
+
+            uint32_t current = chain.back();
+            uint32_t previous = chain.size() > 1 ? chain[chain.size() - 2] : NONE;
+            auto [nearest, distance] = this->get_nearest(current);
+
+            // Prefer the previous link on ties so the chain always terminates in a reciprocal pair.
+            if (previous != NONE) {
+                uint64_t previous_distance = get_distance(this->clusters[current].point, this->clusters[previous].point);
+                if (previous_distance <= distance) {nearest = previous; distance = previous_distance;}
+            }
+
+            if (nearest != previous) {
+
+                // Centroid linkage is not reducible, so a merge can make a cluster further down the chain the nearest. Cut the chain back to it.
+                if (this->clusters[nearest].chained) {
+                    while (chain.back() != nearest) {this->clusters[chain.back()].chained = false; chain.pop_back();}
+                    continue;
+                }
+
+                chain.push_back(nearest);
+                this->clusters[nearest].chained = true;
+                continue;
+
+            }
+
+            chain.pop_back();
+            chain.pop_back();
+            uint32_t merged = this->merge(current, previous, distance);
+            const Cluster& cluster = this->clusters[merged];
+            merges.push_back(Merge{cluster.point, this->clusters[previous].point, this->clusters[current].point, cluster.height, merged, previous, current, cluster.weight});
+
+            if (this->shift < 16u && this->active * 8 < this->cells.size()) {this->set_shift(this->shift + 1u);}
+
+        }
+
+        // Heights are monotone along every path to the root, so a stable sort keeps children ahead of their parents.
+        std::stable_sort(merges.begin(), merges.end(), [](const Merge& a, const Merge& b) {return a.height < b.height;});
+        return merges;
+
     }
 
-    void add_cache(Bucket* bucket) {
-        if (this->cache.find(bucket->best.distance) == this->cache.end()) {this->cache[bucket->best.distance] = std::unordered_set<Bucket*>();}
-        this->cache[bucket->best.distance].insert(bucket);
-    } 
+    std::array<uint16_t, 3> last() const {
+        if (this->active != 1) {throw std::logic_error("NearestNeighbourChain::last: method must be called when there is exactly one final element remaining.");}
+        for (auto it = this->clusters.rbegin(); it != this->clusters.rend(); it++) {if (it->active) {return it->point;}}
+        throw std::logic_error("NearestNeighbourChain::last: no active cluster found.");
+    }
 
-    void remove_cache(Bucket* bucket) {
-        this->cache[bucket->best.distance].erase(bucket);
-        if (this->cache[bucket->best.distance].size() == 0) {this->cache.erase(bucket->best.distance);}
+};
+
+// Counts the 8-bit colours of an rgb or rgba image keyed by their packed 24-bit value, red in the low byte. Large
+// images count straight into a table covering every colour, small ones radix sort their keys instead of paying for it.
+class PixelHistogram {
+
+private:
+
+    static constexpr size_t DENSE_PIXEL_LIMIT = 1u << 20;
+    static constexpr size_t BLOCK_SIZE = 4096;
+
+    std::vector<std::pair<uint32_t, uint32_t>> colors;
+    std::vector<std::vector<std::pair<uint32_t, uint32_t>>> pending;
+
+    // Shuffles four pixels per vector into keys, zeroing alpha. Indices with the high bit set select zero on every target.
+    alignas(16) static constexpr uint8_t PACK_RGB[16] = {0, 1, 2, 0x80, 3, 4, 5, 0x80, 6, 7, 8, 0x80, 9, 10, 11, 0x80};
+    alignas(16) static constexpr uint8_t PACK_RGBA[16] = {0, 1, 2, 0x80, 4, 5, 6, 0x80, 8, 9, 10, 0x80, 12, 13, 14, 0x80};
+
+#ifdef AGGLOMERATIVE_CLUSTERING_X86_DISPATCH
+    // Returns how many pixels it packed, stopping while a whole vector still fits since an rgb vector reads four bytes
+    // past the pixels it packs. The scalar loop does the rest.
+    __attribute__((target("ssse3"))) static size_t pack_ssse3(const uint8_t* data, size_t pixels, size_t stride, uint32_t* keys) {
+        __m128i shuffle = _mm_load_si128(reinterpret_cast<const __m128i*>(stride == 3 ? PACK_RGB : PACK_RGBA));
+        size_t i = 0;
+        for (; i * stride + 16 <= pixels * stride; i += 4) {
+            __m128i vector = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i * stride));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(keys + i), _mm_shuffle_epi8(vector, shuffle));
+        }
+        return i;
     }
+#endif
 
-public:
+    static void pack(const uint8_t* data, size_t pixels, size_t stride, uint32_t* keys) {
+
+        size_t i = 0;
+
+#if defined(__wasm_simd128__) || (defined(__ARM_NEON) && defined(__aarch64__))
+        const uint8_t* shuffle = stride == 3 ? PACK_RGB : PACK_RGBA;
+
+        // An rgb vector reads four bytes past the pixels it packs, so stop while a whole vector still fits.
+        for (; i * stride + 16 <= pixels * stride; i += 4) {
+#if defined(__wasm_simd128__)
+            wasm_v128_store(keys + i, wasm_i8x16_swizzle(wasm_v128_load(data + i * stride), wasm_v128_load(shuffle)));
+#else
+            vst1q_u8(reinterpret_cast<uint8_t*>(keys + i), vqtbl1q_u8(vld1q_u8(data + i * stride), vld1q_u8(shuffle)));
+#endif
+        }
+#elif defined(AGGLOMERATIVE_CLUSTERING_X86_DISPATCH)
+        if (get_cpu_features().ssse3) {i = pack_ssse3(data, pixels, stride, keys);}
+#endif
+
+        for (; i < pixels; i++) {
+            const uint8_t* pixel = data + i * stride;
+            keys[i] = uint32_t(pixel[0]) | (uint32_t(pixel[1]) << 8) | (uint32_t(pixel[2]) << 16);
+        }
 
-    CoarseningGrid(uint16_t resolution) {
-        this->resolution = resolution;
-        this->grid_size = std::numeric_limits<uint16_t>::max() / (1u << this->resolution);
     }
 
-    ~CoarseningGrid() {
-        for (const auto& pair : this->grid) {
-            delete pair.second;
+    static void radix_sort(std::vector<uint32_t>& keys) {
+        std::vector<uint32_t> buffer(keys.size());
+        for (uint32_t shift = 0; shift < 24; shift += 8) {
+            std::array<size_t, 256> offsets{};
+            for (uint32_t key : keys) {offsets[(key >> shift) & 0xFFu]++;}
+            size_t total = 0;
+            for (size_t& offset : offsets) {size_t count = offset; offset = total; total += count;}
+            for (uint32_t key : keys) {buffer[offsets[(key >> shift) & 0xFFu]++] = key;}
+            keys.swap(buffer);
         }
     }
 
-    inline void add(uint16_t x, uint16_t y, uint16_t z) {
-        std::array<uint16_t, 3> point = {x, y, z};
-        this->add(point);
+    // Merges two runs of colours sorted by key, adding up the counts of colours found in both.
+    static std::vector<std::pair<uint32_t, uint32_t>> combine(const std::vector<std::pair<uint32_t, uint32_t>>& a, const std::vector<std::pair<uint32_t, uint32_t>>& b) {
+        std::vector<std::pair<uint32_t, uint32_t>> result;
+        result.reserve(a.size() + b.size());
+        size_t i = 0;
+        size_t j = 0;
+        while (i < a.size() || j < b.size()) {
+            if (j == b.size() || (i < a.size() && a[i].first < b[j].first)) {result.push_back(a[i++]); continue;}
+            if (i == a.size() || b[j].first < a[i].first) {result.push_back(b[j++]); continue;}
+            result.emplace_back(a[i].first, a[i].second + b[j].second);
+            i++;
+            j++;
+        }
+        return result;
     }
 
-    void add(std::array<uint16_t, 3> point) {
+    // Every stripe of the image radix sorts its own keys into a local run of colours, then the runs are merged in pairs.
+    void count_sorted(const uint8_t* data, size_t pixels, size_t stride, size_t threads) {
+
+        std::vector<std::vector<std::pair<uint32_t, uint32_t>>> runs(std::max<size_t>(1u, std::min(threads, pixels)));
+        size_t slices = parallel_for(pixels, threads, [data, stride, &runs](size_t slice, size_t begin, size_t end) {
+            std::vector<uint32_t> keys(end - begin);
+            pack(data + begin * stride, keys.size(), stride, keys.data());
+            radix_sort(keys);
+            for (size_t i = 0; i < keys.size(); i++) {
+                if (i == 0 || keys[i] != keys[i - 1]) {runs[slice].emplace_back(keys[i], 0u);}
+                runs[slice].back().second++;
+            }
+        });
 
-        // If we don't have the required bucket, allocate one.
-        std::array<uint16_t, 3> location = this->get_location(point);
-        if (this->grid.find(location) == this->grid.end()) {
-            Bucket* bucket = new Bucket(location);
-            this->grid[location] = bucket;
-            this->add_cache(bucket);
+        for (size_t width = 1; width < slices; width *= 2) {
+            for (size_t i = 0; i + width < slices; i += 2 * width) {runs[i] = combine(runs[i], runs[i + width]);}
         }
+        this->colors.swap(runs[0]);
 
-        // If we already have this point, don't add it.
-        else if (this->grid[location]->points.find(point) != this->grid[location]->points.end()) {
-            return;
+    }
+
+    // Open addressing table of the colours one stripe has seen, small enough to stay in cache. Keys are 24-bit, so a key
+    // with the top byte set marks an empty slot.
+    struct LocalCounts {
+
+        static constexpr uint32_t BITS = 16;
+        static constexpr uint32_t EMPTY = 0xFFFFFFFFu;
+
+        std::vector<std::pair<uint32_t, uint32_t>> slots = std::vector<std::pair<uint32_t, uint32_t>>(size_t(1) << BITS, {EMPTY, 0u});
+        size_t size = 0;
+
+        // Returns false without counting the key once the table is half full.
+        bool add(uint32_t key) {
+            size_t mask = this->slots.size() - 1;
+            for (size_t slot = (key * 2654435761u) >> (32 - BITS);; slot = (slot + 1) & mask) {
+                if (this->slots[slot].first == key) {this->slots[slot].second++; return true;}
+                if (this->slots[slot].first != EMPTY) {continue;}
+                if (2 * this->size >= this->slots.size()) {return false;}
+                this->slots[slot] = {key, 1u};
+                this->size++;
+                return true;
+            }
         }
 
-        std::vector<Bucket*> buckets = this->get_local_buckets(location);
-        for (Bucket* bucket : buckets) {
+        void clear() {
+            std::fill(this->slots.begin(), this->slots.end(), std::make_pair(EMPTY, 0u));
+            this->size = 0;
+        }
 
-            bool recache = false;
-            Pair best = bucket->best;
+    };
 
-            for (const std::array<uint16_t, 3>& current_point : bucket->points) {
-                Pair pair(current_point, point);
-                if (pair >= best) {continue;}
-                recache = true;
-                best = pair;
+    // Every stripe counts into its own local table first, so few-colour images, where every stripe hits the same handful
+    // of counters, never contend on them. A stripe whose local table fills up has too many colours for that to help: it
+    // adds the table to one shared table of 2^24 relaxed atomic counters, allocated by the first stripe that needs it,
+    // and counts the rest of its pixels straight into the shared table, where threads rarely meet on a counter. When no
+    // stripe overflowed, the local tables are merged as sorted runs and the shared table is never allocated. Otherwise
+    // the leftovers join the shared table, which is then scanned in slices for its colours.
+    void count_dense(const uint8_t* data, size_t pixels, size_t stride, size_t threads) {
+
+        constexpr size_t TABLE_SIZE = size_t(1) << 24;
+        std::unique_ptr<std::atomic<uint32_t>[]> table;
+        std::once_flag allocated;
+
+        auto spill = [&table, &allocated](LocalCounts& local) {
+            std::call_once(allocated, [&table] {table.reset(new std::atomic<uint32_t>[TABLE_SIZE]());});
+            for (const auto& [key, count] : local.slots) {
+                if (key != LocalCounts::EMPTY) {table[key].fetch_add(count, std::memory_order_relaxed);}
             }
+            local.clear();
+        };
 
-            if (!recache) {continue;}
-            this->remove_cache(bucket);
-            bucket->best = best;
-            this->add_cache(bucket);
+        std::vector<LocalCounts> locals(std::max<size_t>(1u, std::min(threads, (pixels + BLOCK_SIZE - 1) / BLOCK_SIZE)));
+        size_t stripes = parallel_for((pixels + BLOCK_SIZE - 1) / BLOCK_SIZE, threads, [data, pixels, stride, &locals, &table, &spill](size_t slice, size_t begin, size_t end) {
+            std::array<uint32_t, BLOCK_SIZE> keys;
+            LocalCounts& local = locals[slice];
+            bool spilled = false;
+            for (size_t block = begin; block < end; block++) {
+                size_t start = block * BLOCK_SIZE;
+                size_t count = std::min(BLOCK_SIZE, pixels - start);
+                pack(data + start * stride, count, stride, keys.data());
+                size_t i = 0;
+                if (!spilled) {for (; i < count && local.add(keys[i]); i++) {}}
+                if (i == count) {continue;}
+                if (!spilled) {spill(local); spilled = true;}
+                for (; i < count; i++) {table[keys[i]].fetch_add(1u, std::memory_order_relaxed);}
+            }
+        });
 
+        if (!table) {
+            std::vector<std::vector<std::pair<uint32_t, uint32_t>>> runs(stripes);
+            for (size_t slice = 0; slice < stripes; slice++) {
+                for (const auto& color : locals[slice].slots) {
+                    if (color.first != LocalCounts::EMPTY) {runs[slice].push_back(color);}
+                }
+                std::sort(runs[slice].begin(), runs[slice].end());
+            }
+            for (size_t width = 1; width < stripes; width *= 2) {
+                for (size_t i = 0; i + width < stripes; i += 2 * width) {runs[i] = combine(runs[i], runs[i + width]);}
+            }
+            this->colors.swap(runs[0]);
+            return;
         }
 
-        // Insert into the bucket
-        this->grid[location]->points.insert(point);
-        
+        parallel_for(stripes, threads, [&locals, &spill](size_t, size_t begin, size_t end) {
+            for (size_t slice = begin; slice < end; slice++) {if (locals[slice].size > 0) {spill(locals[slice]);}}
+        });
+
+        std::vector<std::vector<std::pair<uint32_t, uint32_t>>> found(std::max<size_t>(1u, threads));
+        size_t slices = parallel_for(TABLE_SIZE, threads, [&table, &found](size_t slice, size_t begin, size_t end) {
+            for (size_t key = begin; key < end; key++) {
+                uint32_t count = table[key].load(std::memory_order_relaxed);
+                if (count != 0u) {found[slice].emplace_back(static_cast<uint32_t>(key), count);}
+            }
+        });
+
+        for (size_t slice = 0; slice < slices; slice++) {this->colors.insert(this->colors.end(), found[slice].begin(), found[slice].end());}
+
     }
 
-    inline void remove(uint16_t x, uint16_t y, uint16_t z) {
-        std::array<uint16_t, 3> point = {x, y, z};
-        this->remove(point);
+public:
+
+    static std::array<uint8_t, 3> unpack(uint32_t key) {
+        std::array<uint8_t, 3> result = {static_cast<uint8_t>(key), static_cast<uint8_t>(key >> 8), static_cast<uint8_t>(key >> 16)};
+        return result;
     }
 
-    void remove(std::array<uint16_t, 3> point) {
+    // Format 0 is rgba and format 1 is rgb, matching the image formats of the exported functions.
+    void count(const uint8_t* data, size_t length, int format, size_t threads = 1) {
 
-        // We can't remove a point if there is no bucket for it.
-        std::array<uint16_t, 3> location = this->get_location(point);
-        if (this->grid.find(location) == this->grid.end()) {return;}
-        Bucket* bucket = this->grid[location];
+        AGGLOMERATIVE_CLUSTERING_TIME(histogram_nanoseconds);
+        size_t stride = format == 1 ? 3 : 4;
+        size_t pixels = length / stride;
+        AGGLOMERATIVE_CLUSTERING_COUNT(histogram_pixels, pixels);
+        this->colors.clear();
+        this->pending.clear();
 
-        // If the point isn't in the bucket, we can't remove it.
-        if (bucket->points.find(point) == bucket->points.end()) {return;}
-        this->grid[location]->points.erase(point);
+        if (pixels < DENSE_PIXEL_LIMIT) {this->count_sorted(data, pixels, stride, threads);}
+        else {this->count_dense(data, pixels, stride, threads);}
 
-        // If the bucket is empty delete the bucket.
-        if (bucket->points.size() == 0) {
-            this->grid.erase(location);
-            this->remove_cache(bucket);
-            delete bucket;
+    }
+
+    // Counts another chunk of an image on top of what has been counted so far. Each chunk becomes a run of colours, and
+    // the newest two runs merge whenever the older one is at most twice the size of the newer one. Merging therefore
+    // costs O(n log n) over any number of chunks while memory stays proportional to the distinct colours. Every pixel of
+    // the chunk counts weight times, so images sharing one histogram can weigh differently.
+    void add(const uint8_t* data, size_t length, int format, size_t threads = 1, uint32_t weight = 1u) {
+
+        PixelHistogram chunk;
+        chunk.count(data, length, format, threads);
+        if (chunk.colors.empty() || weight == 0u) {return;}
+        if (weight != 1u) {
+            for (std::pair<uint32_t, uint32_t>& color : chunk.colors) {color.second = static_cast<uint32_t>(std::min<uint64_t>(uint64_t(color.second) * weight, std::numeric_limits<uint32_t>::max()));}
         }
+        this->pending.push_back(std::move(chunk.colors));
 
-        std::vector<Bucket*> buckets = this->get_local_buckets(location);
-        for (Bucket* bucket : buckets) {
+        AGGLOMERATIVE_CLUSTERING_TIME(histogram_nanoseconds);
+        while (this->pending.size() > 1 && this->pending[this->pending.size() - 2].size() <= 2 * this->pending.back().size()) {
+            std::vector<std::pair<uint32_t, uint32_t>> merged = combine(this->pending[this->pending.size() - 2], this->pending.back());
+            this->pending.pop_back();
+            this->pending.back().swap(merged);
+        }
 
-            // If the best point doesn't include the removed point we don't need to recache.
-            if (!bucket->best.contains(point)) {continue;}
-            this->remove_cache(bucket);
-            bucket->best = Pair();
-
-            // Brute force closest point search, this should be okay since there should not be too many points.
-            std::vector<std::array<uint16_t, 3>> local_points = this->get_local_points(bucket->location);
-            for (size_t i = 0; i < local_points.size(); i++) {
-                for (const std::array<uint16_t, 3>& current_point : bucket->points) {
-                    if (current_point == local_points[i]) {continue;}
-                    Pair pair(current_point, local_points[i]);
-                    if (pair >= bucket->best) {continue;}
-                    bucket->best = pair;
-                }
+    }
+
+    // Folds every run added since the last flush into the colours visible through begin and end.
+    void flush() {
+        AGGLOMERATIVE_CLUSTERING_TIME(histogram_nanoseconds);
+        for (const std::vector<std::pair<uint32_t, uint32_t>>& run : this->pending) {this->colors = combine(this->colors, run);}
+        this->pending.clear();
+    }
+
+    // Merges colours that agree in their top bits on every channel into one colour at their weighted mean, and returns
+    // the mean squared distance by which that moved each counted pixel.
+    double reduce(uint32_t bits) {
+
+        if (bits >= 8u || this->colors.empty()) {return 0.0;}
+        uint32_t mask = (0xFFu << (8u - bits)) & 0xFFu;
+        uint32_t key_mask = mask | (mask << 8) | (mask << 16);
+
+        std::vector<std::pair<uint32_t, uint32_t>> binned(this->colors.size());
+        for (size_t i = 0; i < this->colors.size(); i++) {binned[i] = std::make_pair(this->colors[i].first & key_mask, static_cast<uint32_t>(i));}
+        std::sort(binned.begin(), binned.end());
+
+        std::vector<std::pair<uint32_t, uint32_t>> reduced;
+        double error = 0.0;
+        uint64_t total = 0;
+
+        for (size_t start = 0; start < binned.size();) {
+
+            size_t end = start;
+            std::array<uint64_t, 3> sum = {0u, 0u, 0u};
+            uint64_t count = 0;
+            for (; end < binned.size() && binned[end].first == binned[start].first; end++) {
+                const auto& [key, weight] = this->colors[binned[end].second];
+                std::array<uint8_t, 3> color = unpack(key);
+                for (size_t c = 0; c < 3; c++) {sum[c] += uint64_t(color[c]) * weight;}
+                count += weight;
+            }
+
+            std::array<uint8_t, 3> mean;
+            for (size_t c = 0; c < 3; c++) {mean[c] = static_cast<uint8_t>((sum[c] + count / 2) / count);}
+            for (size_t i = start; i < end; i++) {
+                const auto& [key, weight] = this->colors[binned[i].second];
+                std::array<uint8_t, 3> color = unpack(key);
+                double distance = 0.0;
+                for (size_t c = 0; c < 3; c++) {distance += (double(color[c]) - double(mean[c])) * (double(color[c]) - double(mean[c]));}
+                error += distance * weight;
             }
 
-            this->add_cache(bucket);
+            reduced.emplace_back(uint32_t(mean[0]) | (uint32_t(mean[1]) << 8) | (uint32_t(mean[2]) << 16), static_cast<uint32_t>(count));
+            total += count;
+            start = end;
 
         }
 
-    }
-    
-    [[nodiscard]] std::optional<std::pair<std::array<uint16_t, 3>, std::array<uint16_t, 3>>> get_nearest() {
-    
-        if (this->cache.size() == 0) {return std::nullopt;}
-        std::unordered_set<Bucket*> best_buckets = this->cache.begin()->second;
+        // A weighted mean stays inside its bin, so bins keep distinct colours and only need sorting back into key order.
+        std::sort(reduced.begin(), reduced.end());
+        this->colors.swap(reduced);
+        return error / double(total);
 
-        Pair best = (*best_buckets.begin())->best;
-        if (best.distance != std::numeric_limits<uint64_t>::max()) {return std::make_pair(best.a, best.b);}
-        if (best.distance == std::numeric_limits<uint64_t>::max() && this->resolution == 0u) {return std::nullopt;}
+    }
 
-        std::vector<std::array<uint16_t, 3>> points = this->get_all_points();
-        for (const auto& pair : this->grid) {delete pair.second;}
-        this->cache.clear();
-        this->grid.clear();
+    size_t size() const {
+        return this->colors.size();
+    }
 
-        this->resolution = this->resolution - 1u;
-        this->grid_size = std::numeric_limits<uint16_t>::max() / (1u << this->resolution);
-        for (std::array<uint16_t, 3> point : points) {this->add(point);}
-        return this->get_nearest();
+    auto begin() const {
+        return this->colors.begin();
+    }
 
+    auto end() const {
+        return this->colors.end();
     }
 
 };
 
+// Weights of the clusters still being merged, keyed by their points. Points of up to four bytes hash as one packed
+// 32-bit integer rather than coordinate by coordinate.
+template<typename Coordinate = uint16_t, size_t Dimensions = 3>
 class AgglomerativeHistogram {
 
+public:
+
+    using Point = std::array<Coordinate, Dimensions>;
+
 private:
 
     struct ArrayHash {
-        std::size_t operator()(const std::array<uint16_t, 3>& arr) const noexcept {
-            size_t seed = 0;
-            for (auto elem : arr) {seed ^= std::hash<uint16_t>{}(elem) + 0x9e3779b9 + (seed << 6) + (seed >> 2);}
-            return seed;
+        std::size_t operator()(const Point& arr) const noexcept {
+            if constexpr (sizeof(Point) <= 4u) {
+                uint32_t key = 0;
+                for (auto elem : arr) {key = (key << (8u * sizeof(Coordinate))) | elem;}
+                return std::hash<uint32_t>{}(key * 0x9e3779b1u);
+            }
+            else {
+                size_t seed = 0;
+                for (auto elem : arr) {seed ^= std::hash<Coordinate>{}(elem) + 0x9e3779b9 + (seed << 6) + (seed >> 2);}
+                return seed;
+            }
         }
     };
 
-    std::unordered_map<std::array<uint16_t, 3>, uint32_t, ArrayHash> histogram;
+    std::unordered_map<Point, uint32_t, ArrayHash> histogram;
 
 public: 
 
-    bool count(std::array<uint16_t, 3> color) {
+    bool count(Point color, uint32_t amount = 1u) {
         auto it = this->histogram.find(color);
-        if (it != this->histogram.end()) {it->second++; return false;}
-        this->histogram[color] = 1u;
+        if (it != this->histogram.end()) {it->second += amount; return false;}
+        this->histogram[color] = amount;
         return true;
     }
 
-    std::array<uint16_t, 3> merge(std::array<uint16_t, 3> a, std::array<uint16_t, 3> b) {
+    void reserve(size_t size) {
+        this->histogram.reserve(size);
+    }
+
+    Point merge(Point a, Point b) {
 
         uint32_t a_count = this->histogram[a];
         uint32_t b_count = this->histogram[b];
@@ -300,18 +1875,17 @@ public:
         double a_ratio = (double) a_count / (double) merged_count;
         double b_ratio = (double) b_count / (double) merged_count;
 
-        std::array<uint16_t, 3> merged = {
-            static_cast<uint16_t>(a[0] * a_ratio + b[0] * b_ratio),
-            static_cast<uint16_t>(a[1] * a_ratio + b[1] * b_ratio),
-            static_cast<uint16_t>(a[2] * a_ratio + b[2] * b_ratio)
-        };
+        // 16-bit coordinates truncate as they always have, while 8-bit ones round so merges don't drift towards black.
+        Point merged;
+        double rounding = sizeof(Coordinate) == 1u ? 0.5 : 0.0;
+        for (size_t i = 0; i < Dimensions; i++) {merged[i] = static_cast<Coordinate>(a[i] * a_ratio + b[i] * b_ratio + rounding);}
 
         this->histogram.erase(a);
         this->histogram.erase(b);
 
         auto it = this->histogram.find(merged);
         if (it != this->histogram.end()) {it->second += merged_count;}
-        this->histogram[merged] = merged_count;
+        else {this->histogram[merged] = merged_count;}
 
         return merged;
 
@@ -321,7 +1895,15 @@ public:
         return this->histogram.size();
     }
 
-    std::array<uint16_t, 3> last() {
+    auto begin() const {
+        return this->histogram.begin();
+    }
+
+    auto end() const {
+        return this->histogram.end();
+    }
+
+    Point last() {
         if (this->histogram.size() != 1) {throw std::logic_error("AgglomerativeHistogram::last: method must be called when there is exactly one final element remaining.");}
         return this->histogram.begin()->first;
     }
@@ -332,8 +1914,10 @@ class KDTree {
 
 private:
 
+    // Each node keeps the position of its point in the built list, so equally near points resolve to the earliest.
     struct Node {
         std::array<uint8_t, 3> point;
+        uint32_t index = 0;
         int left = -1;
         int right = -1;
     };
@@ -341,20 +1925,20 @@ private:
     std::vector<Node> nodes;
     int root = -1;
 
-    int build(std::vector<std::array<uint8_t, 3>>& points, int start, int end, int depth) {
+    int build(std::vector<Node>& points, int start, int end, int depth) {
 
         if (start >= end) {return -1;}
         int mid = (start + end) / 2;
         int axis = depth % 3;
         
-        auto comparator = [axis](const std::array<uint8_t, 3>& a, const std::array<uint8_t, 3>& b) {
-            if (axis == 0) {return a[0] < b[0];}
-            if (axis == 1) {return a[1] < b[1];}
-            return a[2] < b[2];
+        auto comparator = [axis](const Node& a, const Node& b) {
+            if (axis == 0) {return a.point[0] < b.point[0];}
+            if (axis == 1) {return a.point[1] < b.point[1];}
+            return a.point[2] < b.point[2];
         };
 
         std::nth_element(points.begin() + start, points.begin() + mid, points.begin() + end, comparator);
-        this->nodes.push_back(Node{points[mid], -1, -1});
+        this->nodes.push_back(Node{points[mid].point, points[mid].index, -1, -1});
         int node_index = (int) this->nodes.size() - 1;
 
         this->nodes[node_index].left = build(points, start, mid, depth + 1);
@@ -364,21 +1948,11 @@ private:
 
     }
 
-public:
-
-    void build(std::vector<std::array<uint8_t, 3>> points) {
-        this->nodes.clear();
-        this->root = this->build(points, 0, (int) points.size(), 0);
-    }
-
-    [[nodiscard]] std::array<uint8_t, 3> get_nearest(const std::array<uint8_t, 3>& target) const {
-
-        if (this->root == -1) {
-            std::array<uint8_t, 3> result = {0u, 0u, 0u};
-            return result;
-        }
+    // Subtrees across a splitting plane exactly as far as the best distance are still searched, since they may hold an
+    // earlier point at that same distance.
+    const Node& search(const std::array<uint8_t, 3>& target) const {
 
-        std::array<uint8_t, 3> best_point;
+        const Node* best = nullptr;
         uint32_t best_distance = std::numeric_limits<uint32_t>::max();
 
         struct StackFrame {
@@ -388,11 +1962,13 @@ public:
 
         std::stack<StackFrame> fringe;
         fringe.push({root, 0});
+        [[maybe_unused]] uint64_t visited = 0;
 
         while (!fringe.empty()) {
 
             StackFrame frame = fringe.top();
             fringe.pop();
+            visited++;
 
             const Node& node = this->nodes[frame.node_index];
             uint32_t dx = static_cast<uint32_t>(node.point[0] > target[0] ? node.point[0] - target[0] : target[0] - node.point[0]);
@@ -400,9 +1976,9 @@ public:
             uint32_t dz = static_cast<uint32_t>(node.point[2] > target[2] ? node.point[2] - target[2] : target[2] - node.point[2]);
             uint32_t distance = dx * dx + dy * dy + dz * dz;
 
-            if (distance < best_distance) {
+            if (distance < best_distance || (distance == best_distance && node.index < best->index)) {
                 best_distance = distance;
-                best_point = node.point;
+                best = &node;
             }
 
             int axis = frame.depth % 3;
@@ -415,14 +1991,371 @@ public:
             int second = difference < 0 ? node.right : node.left;
 
             if (first != -1) {fringe.push({first, frame.depth + 1});}
-            if (second != -1 && difference * difference < best_distance) {fringe.push({second, frame.depth + 1});}
+            if (second != -1 && uint32_t(difference * difference) <= best_distance) {fringe.push({second, frame.depth + 1});}
 
         }
 
-        return best_point;
+        AGGLOMERATIVE_CLUSTERING_COUNT(kdtree_queries, 1);
+        AGGLOMERATIVE_CLUSTERING_COUNT(kdtree_nodes_visited, visited);
+        return *best;
     
     }
 
+public:
+
+    void build(const std::vector<std::array<uint8_t, 3>>& points) {
+        std::vector<Node> entries;
+        entries.reserve(points.size());
+        for (size_t i = 0; i < points.size(); i++) {entries.push_back(Node{points[i], static_cast<uint32_t>(i), -1, -1});}
+        this->nodes.clear();
+        this->root = this->build(entries, 0, (int) entries.size(), 0);
+    }
+
+    [[nodiscard]] std::array<uint8_t, 3> get_nearest(const std::array<uint8_t, 3>& target) const {
+        if (this->root == -1) {return {0u, 0u, 0u};}
+        return this->search(target).point;
+    }
+
+    // Position of the nearest point in the list the tree was built from, the earliest of any equally near. Must not be
+    // called on an empty tree.
+    [[nodiscard]] size_t get_nearest_index(const std::array<uint8_t, 3>& target) const {
+        return this->search(target).index;
+    }
+
+};
+
+// Finds the nearest palette colour. Small palettes are compared against every entry, several at a time in vector
+// registers, which beats walking a KDTree. Larger palettes fall back to the tree. When enough lookups are expected to
+// pay for it, an inverse colour map is built instead. Every strategy is exact, and ties go to the earliest entry.
+class PaletteMatcher {
+
+private:
+
+    enum class Strategy {BruteForce, InverseMap, Tree};
+#ifdef AGGLOMERATIVE_CLUSTERING_X86_DISPATCH
+    enum class Kernel {Scalar, Sse41, Avx2};
+#endif
+
+    static constexpr size_t BRUTE_FORCE_LIMIT = 256;
+    static constexpr size_t INVERSE_MAP_LIMIT = 4096;
+    static constexpr size_t SCALAR_ENTRIES_PER_CHECK = 4;
+    static constexpr size_t SSE41_ENTRIES_PER_CHECK = 12;
+    static constexpr size_t AVX2_ENTRIES_PER_CHECK = 16;
+    static constexpr size_t TREE_CHECKS_PER_LEVEL = 64;
+    static constexpr size_t LANES = 8;
+    static constexpr uint32_t CELL_BITS = 5;
+    static constexpr uint32_t CELL_SHIFT = 8u - CELL_BITS;
+    static constexpr size_t CELL_COUNT = size_t(1) << (3 * CELL_BITS);
+
+    std::vector<std::array<uint8_t, 3>> colors;
+    std::vector<int32_t> red;
+    std::vector<int32_t> green;
+    std::vector<int32_t> blue;
+    std::vector<uint32_t> cell_offsets;
+    std::vector<uint32_t> cell_candidates;
+    KDTree tree;
+    Strategy strategy = Strategy::BruteForce;
+#ifdef AGGLOMERATIVE_CLUSTERING_X86_DISPATCH
+    Kernel kernel = Kernel::Scalar;
+#endif
+
+    static size_t get_cell(const std::array<uint8_t, 3>& color) {
+        return (size_t(color[0] >> CELL_SHIFT) << (2 * CELL_BITS)) | (size_t(color[1] >> CELL_SHIFT) << CELL_BITS) | size_t(color[2] >> CELL_SHIFT);
+    }
+
+    // Splits colour space into 32^3 cells and keeps, for each cell, the entries that can be nearest to some colour in
+    // it: those no further from the cell than the smallest distance within which a single entry covers the whole cell.
+    // Cells left with one candidate resolve with a single read, the rest only compare their few candidates.
+    void build_inverse_map(size_t threads) {
+
+        constexpr int32_t WIDTH = (1 << CELL_SHIFT) - 1;
+        constexpr size_t MASK = (size_t(1) << CELL_BITS) - 1;
+
+        std::vector<uint32_t> counts(CELL_COUNT, 0u);
+        std::vector<std::vector<uint32_t>> found(std::max<size_t>(1u, std::min(threads, CELL_COUNT)));
+        size_t slices = parallel_for(CELL_COUNT, threads, [this, &counts, &found](size_t slice, size_t begin, size_t end) {
+
+            std::vector<int32_t> near(this->colors.size());
+            for (size_t cell = begin; cell < end; cell++) {
+
+                std::array<int32_t, 3> low = {
+                    int32_t(cell >> (2 * CELL_BITS)) << CELL_SHIFT,
+                    int32_t((cell >> CELL_BITS) & MASK) << CELL_SHIFT,
+                    int32_t(cell & MASK) << CELL_SHIFT
+                };
+
+                int32_t bound = std::numeric_limits<int32_t>::max();
+                for (size_t i = 0; i < this->colors.size(); i++) {
+                    int32_t minimum = 0;
+                    int32_t maximum = 0;
+                    for (size_t c = 0; c < 3; c++) {
+                        int32_t value = this->colors[i][c];
+                        int32_t gap = std::max({low[c] - value, value - low[c] - WIDTH, 0});
+                        int32_t span = std::max(std::abs(value - low[c]), std::abs(value - low[c] - WIDTH));
+                        minimum += gap * gap;
+                        maximum += span * span;
+                    }
+                    near[i] = minimum;
+                    bound = std::min(bound, maximum);
+                }
+
+                for (size_t i = 0; i < this->colors.size(); i++) {
+                    if (near[i] > bound) {continue;}
+                    found[slice].push_back(static_cast<uint32_t>(i));
+                    counts[cell]++;
+                }
+
+            }
+
+        });
+
+        this->cell_offsets.assign(CELL_COUNT + 1, 0u);
+        for (size_t cell = 0; cell < CELL_COUNT; cell++) {this->cell_offsets[cell + 1] = this->cell_offsets[cell] + counts[cell];}
+        this->cell_candidates.clear();
+        this->cell_candidates.reserve(this->cell_offsets.back());
+        for (size_t slice = 0; slice < slices; slice++) {this->cell_candidates.insert(this->cell_candidates.end(), found[slice].begin(), found[slice].end());}
+
+    }
+
+    // Building the map takes CELL_COUNT checks per palette entry, and it pays for itself once the lookups it speeds up
+    // would have cost as much. A lookup without it costs about one such check per few padded entries by brute force,
+    // more of them the wider the kernel, or TREE_CHECKS_PER_LEVEL per level of the tree, so the queries needed follow
+    // the ratio of the palette to that cost. The constants come from timing the strategies on photos, gradients and
+    // noise, 4-lane wasm and NEON kernels assumed to match SSE4.1.
+    size_t get_inverse_map_threshold(size_t size) const {
+
+        size_t entries = SCALAR_ENTRIES_PER_CHECK;
+#if defined(AGGLOMERATIVE_CLUSTERING_X86_DISPATCH)
+        if (this->kernel == Kernel::Avx2) {entries = AVX2_ENTRIES_PER_CHECK;}
+        if (this->kernel == Kernel::Sse41) {entries = SSE41_ENTRIES_PER_CHECK;}
+#elif defined(__wasm_simd128__) || (defined(__ARM_NEON) && defined(__aarch64__))
+        entries = SSE41_ENTRIES_PER_CHECK;
+#endif
+
+        size_t cost = std::max<size_t>(1u, (size + LANES - 1) / LANES * LANES / entries);
+        if (size > BRUTE_FORCE_LIMIT) {
+            size_t levels = 0;
+            while ((size_t(1) << levels) < size) {levels++;}
+            cost = TREE_CHECKS_PER_LEVEL * levels;
+        }
+
+        return CELL_COUNT * size / cost;
+
+    }
+
+    size_t lookup(const std::array<uint8_t, 3>& target) const {
+
+        size_t cell = get_cell(target);
+        const uint32_t* begin = this->cell_candidates.data() + this->cell_offsets[cell];
+        const uint32_t* end = this->cell_candidates.data() + this->cell_offsets[cell + 1];
+        if (end - begin == 1) {return *begin;}
+
+        size_t result = *begin;
+        int32_t result_distance = std::numeric_limits<int32_t>::max();
+        for (const uint32_t* candidate = begin; candidate != end; candidate++) {
+            const std::array<uint8_t, 3>& color = this->colors[*candidate];
+            int32_t dr = int32_t(color[0]) - target[0];
+            int32_t dg = int32_t(color[1]) - target[1];
+            int32_t db = int32_t(color[2]) - target[2];
+            int32_t distance = dr * dr + dg * dg + db * db;
+            if (distance >= result_distance) {continue;}
+            result = *candidate;
+            result_distance = distance;
+        }
+        return result;
+
+    }
+
+#ifdef AGGLOMERATIVE_CLUSTERING_X86_DISPATCH
+    __attribute__((target("avx2"))) static void search_avx2(const int32_t* r, const int32_t* g, const int32_t* b, size_t count, const std::array<uint8_t, 3>& target, int32_t* distances, int32_t* indices) {
+        __m256i tr = _mm256_set1_epi32(target[0]);
+        __m256i tg = _mm256_set1_epi32(target[1]);
+        __m256i tb = _mm256_set1_epi32(target[2]);
+        __m256i best = _mm256_set1_epi32(std::numeric_limits<int32_t>::max());
+        __m256i best_index = _mm256_setzero_si256();
+        __m256i index = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+        __m256i step = _mm256_set1_epi32(8);
+        for (size_t i = 0; i < count; i += 8) {
+            __m256i dr = _mm256_sub_epi32(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(r + i)), tr);
+            __m256i dg = _mm256_sub_epi32(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(g + i)), tg);
+            __m256i db = _mm256_sub_epi32(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(b + i)), tb);
+            __m256i distance = _mm256_add_epi32(_mm256_add_epi32(_mm256_mullo_epi32(dr, dr), _mm256_mullo_epi32(dg, dg)), _mm256_mullo_epi32(db, db));
+            __m256i closer = _mm256_cmpgt_epi32(best, distance);
+            best = _mm256_min_epi32(best, distance);
+            best_index = _mm256_blendv_epi8(best_index, index, closer);
+            index = _mm256_add_epi32(index, step);
+        }
+        _mm256_store_si256(reinterpret_cast<__m256i*>(distances), best);
+        _mm256_store_si256(reinterpret_cast<__m256i*>(indices), best_index);
+    }
+
+    __attribute__((target("sse4.1"))) static void search_sse41(const int32_t* r, const int32_t* g, const int32_t* b, size_t count, const std::array<uint8_t, 3>& target, int32_t* distances, int32_t* indices) {
+        __m128i tr = _mm_set1_epi32(target[0]);
+        __m128i tg = _mm_set1_epi32(target[1]);
+        __m128i tb = _mm_set1_epi32(target[2]);
+        __m128i best = _mm_set1_epi32(std::numeric_limits<int32_t>::max());
+        __m128i best_index = _mm_setzero_si128();
+        __m128i index = _mm_setr_epi32(0, 1, 2, 3);
+        __m128i step = _mm_set1_epi32(4);
+        for (size_t i = 0; i < count; i += 4) {
+            __m128i dr = _mm_sub_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(r + i)), tr);
+            __m128i dg = _mm_sub_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(g + i)), tg);
+            __m128i db = _mm_sub_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(b + i)), tb);
+            __m128i distance = _mm_add_epi32(_mm_add_epi32(_mm_mullo_epi32(dr, dr), _mm_mullo_epi32(dg, dg)), _mm_mullo_epi32(db, db));
+            __m128i closer = _mm_cmplt_epi32(distance, best);
+            best = _mm_min_epi32(best, distance);
+            best_index = _mm_blendv_epi8(best_index, index, closer);
+            index = _mm_add_epi32(index, step);
+        }
+        _mm_store_si128(reinterpret_cast<__m128i*>(distances), best);
+        _mm_store_si128(reinterpret_cast<__m128i*>(indices), best_index);
+    }
+#endif
+
+    static void search_scalar(const int32_t* r, const int32_t* g, const int32_t* b, size_t count, const std::array<uint8_t, 3>& target, int32_t* distances, int32_t* indices) {
+        std::fill(distances, distances + LANES, std::numeric_limits<int32_t>::max());
+        std::fill(indices, indices + LANES, 0);
+        for (size_t i = 0; i < count; i++) {
+            int32_t dr = r[i] - target[0];
+            int32_t dg = g[i] - target[1];
+            int32_t db = b[i] - target[2];
+            int32_t distance = dr * dr + dg * dg + db * db;
+            if (distance >= distances[i % LANES]) {continue;}
+            distances[i % LANES] = distance;
+            indices[i % LANES] = static_cast<int32_t>(i);
+        }
+    }
+
+    size_t search(const std::array<uint8_t, 3>& target) const {
+
+        const int32_t* r = this->red.data();
+        const int32_t* g = this->green.data();
+        const int32_t* b = this->blue.data();
+        size_t count = this->red.size();
+
+        // Each lane keeps the closest entry it has seen, and lanes are reduced at the end.
+        alignas(32) std::array<int32_t, LANES> distances;
+        alignas(32) std::array<int32_t, LANES> indices;
+        size_t lanes = LANES;
+
+#if defined(AGGLOMERATIVE_CLUSTERING_X86_DISPATCH)
+        if (this->kernel == Kernel::Avx2) {search_avx2(r, g, b, count, target, distances.data(), indices.data());}
+        else if (this->kernel == Kernel::Sse41) {lanes = 4; search_sse41(r, g, b, count, target, distances.data(), indices.data());}
+        else {search_scalar(r, g, b, count, target, distances.data(), indices.data());}
+#elif defined(__wasm_simd128__)
+        lanes = 4;
+        v128_t tr = wasm_i32x4_splat(target[0]);
+        v128_t tg = wasm_i32x4_splat(target[1]);
+        v128_t tb = wasm_i32x4_splat(target[2]);
+        v128_t best = wasm_i32x4_splat(std::numeric_limits<int32_t>::max());
+        v128_t best_index = wasm_i32x4_splat(0);
+        v128_t index = wasm_i32x4_make(0, 1, 2, 3);
+        v128_t step = wasm_i32x4_splat(4);
+        for (size_t i = 0; i < count; i += 4) {
+            v128_t dr = wasm_i32x4_sub(wasm_v128_load(r + i), tr);
+            v128_t dg = wasm_i32x4_sub(wasm_v128_load(g + i), tg);
+            v128_t db = wasm_i32x4_sub(wasm_v128_load(b + i), tb);
+            v128_t distance = wasm_i32x4_add(wasm_i32x4_add(wasm_i32x4_mul(dr, dr), wasm_i32x4_mul(dg, dg)), wasm_i32x4_mul(db, db));
+            v128_t closer = wasm_i32x4_lt(distance, best);
+            best = wasm_i32x4_min(best, distance);
+            best_index = wasm_v128_bitselect(index, best_index, closer);
+            index = wasm_i32x4_add(index, step);
+        }
+        wasm_v128_store(distances.data(), best);
+        wasm_v128_store(indices.data(), best_index);
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+        lanes = 4;
+        int32x4_t tr = vdupq_n_s32(target[0]);
+        int32x4_t tg = vdupq_n_s32(target[1]);
+        int32x4_t tb = vdupq_n_s32(target[2]);
+        int32x4_t best = vdupq_n_s32(std::numeric_limits<int32_t>::max());
+        int32x4_t best_index = vdupq_n_s32(0);
+        alignas(16) static constexpr int32_t START[4] = {0, 1, 2, 3};
+        int32x4_t index = vld1q_s32(START);
+        int32x4_t step = vdupq_n_s32(4);
+        for (size_t i = 0; i < count; i += 4) {
+            int32x4_t dr = vsubq_s32(vld1q_s32(r + i), tr);
+            int32x4_t dg = vsubq_s32(vld1q_s32(g + i), tg);
+            int32x4_t db = vsubq_s32(vld1q_s32(b + i), tb);
+            int32x4_t distance = vmlaq_s32(vmlaq_s32(vmulq_s32(dr, dr), dg, dg), db, db);
+            uint32x4_t closer = vcltq_s32(distance, best);
+            best = vminq_s32(best, distance);
+            best_index = vbslq_s32(closer, index, best_index);
+            index = vaddq_s32(index, step);
+        }
+        vst1q_s32(distances.data(), best);
+        vst1q_s32(indices.data(), best_index);
+#else
+        search_scalar(r, g, b, count, target, distances.data(), indices.data());
+#endif
+
+        size_t result = static_cast<size_t>(indices[0]);
+        int32_t result_distance = distances[0];
+        for (size_t lane = 1; lane < lanes; lane++) {
+            if (distances[lane] > result_distance || (distances[lane] == result_distance && static_cast<size_t>(indices[lane]) > result)) {continue;}
+            result = static_cast<size_t>(indices[lane]);
+            result_distance = distances[lane];
+        }
+        return result;
+
+    }
+
+public:
+
+    // The expected number of lookups decides whether building the inverse colour map will pay for itself.
+    void build(const std::vector<std::array<uint8_t, 3>>& colors, size_t queries = 0, size_t threads = 1) {
+
+        this->colors = colors;
+        this->red.clear();
+        this->green.clear();
+        this->blue.clear();
+        this->cell_offsets.clear();
+        this->cell_candidates.clear();
+
+#ifdef AGGLOMERATIVE_CLUSTERING_X86_DISPATCH
+        const CpuFeatures& features = get_cpu_features();
+        this->kernel = features.avx2 ? Kernel::Avx2 : (features.sse41 ? Kernel::Sse41 : Kernel::Scalar);
+#endif
+
+        if (colors.empty()) {this->strategy = Strategy::BruteForce; return;}
+        if (colors.size() <= INVERSE_MAP_LIMIT && queries >= this->get_inverse_map_threshold(colors.size())) {this->strategy = Strategy::InverseMap; this->build_inverse_map(threads); return;}
+
+        if (colors.size() > BRUTE_FORCE_LIMIT) {
+            this->strategy = Strategy::Tree;
+            this->tree.build(colors);
+            return;
+        }
+
+        this->strategy = Strategy::BruteForce;
+
+        // Padding repeats the first entry, which can never win a tie against it, so the kernels need no tail loop.
+        size_t padded = (colors.size() + LANES - 1) / LANES * LANES;
+        for (size_t i = 0; i < padded; i++) {
+            const std::array<uint8_t, 3>& color = colors[i < colors.size() ? i : 0];
+            this->red.push_back(color[0]);
+            this->green.push_back(color[1]);
+            this->blue.push_back(color[2]);
+        }
+
+    }
+
+    size_t size() const {
+        return this->colors.size();
+    }
+
+    // Must not be called on an empty palette.
+    [[nodiscard]] size_t get_nearest_index(const std::array<uint8_t, 3>& target) const {
+        if (this->strategy == Strategy::InverseMap) {return this->lookup(target);}
+        if (this->strategy == Strategy::Tree) {return this->tree.get_nearest_index(target);}
+        return this->search(target);
+    }
+
+    [[nodiscard]] std::array<uint8_t, 3> get_nearest(const std::array<uint8_t, 3>& target) const {
+        if (this->colors.empty()) {return {0u, 0u, 0u};}
+        if (this->strategy == Strategy::Tree) {return this->tree.get_nearest(target);}
+        return this->colors[this->get_nearest_index(target)];
+    }
+
 };
 
 }
@@ -1,16 +1,61 @@
 import createWasmModule from './clustering.js';
 const codes = {'rgba': 0, 'rgb': 1};
+// 'parallel' is the former name of 'reciprocal', kept so existing callers keep working.
+const engines = {'grid': 0, 'chain': 1, 'reciprocal': 2, 'compact': 3, 'parallel': 2};
 let Module = null;
 
 export const init = async () => {
     if (!Module) {Module = await createWasmModule();}
 };
 
+// Inputs and in place outputs live in persistent regions of the WASM heap that are only reallocated when they need to grow.
+const regions = {};
+
+const reserve = (name, length) => {
+    const region = regions[name];
+    if (region && region.length >= length) {return region.pointer;}
+    if (region) {Module._free(region.pointer);}
+    regions[name] = {pointer: Module._malloc(Math.max(length, 1)), length: Math.max(length, 1)};
+    return regions[name].pointer;
+};
+
+// Copies data into its region, unless it already is a view of that region handed out by getInputBuffer.
+const stage = (name, data) => {
+    const region = regions[name];
+    if (region && data.buffer === Module.HEAPU8.buffer && data.byteOffset === region.pointer) {return region.pointer;}
+    const pointer = reserve(name, data.length);
+    Module.HEAPU8.set(data, pointer);
+    return pointer;
+};
+
+const view = (name, length) => {
+    const pointer = regions[name].pointer;
+    return Module.HEAPU8.subarray(pointer, pointer + length);
+};
+
 const unpack = (pointer) => {
-    const lengthBuffer = new Uint8Array(Module.HEAPU8.subarray(pointer, pointer + 4));
-    const length = lengthBuffer[0] | (lengthBuffer[1] << 8) | (lengthBuffer[2] << 16) | (lengthBuffer[3] << 24);
-    const outputBuffer = new Uint8Array(Module.HEAPU8.subarray(pointer + 4, pointer + 4 + length));
-    return outputBuffer;
+    const heap = Module.HEAPU8;
+    const length = heap[pointer] | (heap[pointer + 1] << 8) | (heap[pointer + 2] << 16) | (heap[pointer + 3] << 24);
+    return heap.slice(pointer + 4, pointer + 4 + length);
+};
+
+const split = (output, alpha) => {
+    const count = output[0] | (output[1] << 8);
+    const pixels = alpha ? (output.length - 2 - 3 * count) / 2 : output.length - 2 - 3 * count;
+    const palette = output.subarray(2, 2 + 3 * count);
+    const indices = output.subarray(2 + 3 * count, 2 + 3 * count + pixels);
+    return alpha ? {palette, indices, alpha: output.subarray(2 + 3 * count + pixels)} : {palette, indices};
+};
+
+// Splits the palettes of a batch call, each stored as a 32-bit colour count followed by its colours.
+const palettes = (output) => {
+    const result = [];
+    for (let offset = 0; offset < output.length;) {
+        const count = output[offset] | (output[offset + 1] << 8) | (output[offset + 2] << 16) | (output[offset + 3] << 24);
+        result.push(output.subarray(offset + 4, offset + 4 + 3 * count));
+        offset += 4 + 3 * count;
+    }
+    return result;
 };
 
 const load = (image) => {
@@ -35,6 +80,26 @@ const load = (image) => {
 
 };
 
+const size = (image) => {
+    const stride = image.format === 'rgb' ? 3 : 4;
+    return Math.floor(image.data.length / stride) * stride;
+};
+
+// Returns a view of WASM memory to write an image into, for example straight from a decoder. Passing it back as the image
+// data of the next call skips copying it onto the heap. Any call may grow the heap, which detaches earlier views.
+export const getInputBuffer = async (length) => {
+    await init();
+    reserve('image', length);
+    return view('image', length);
+};
+
+export const releaseBuffers = () => {
+    for (const name of Object.keys(regions)) {
+        Module._free(regions[name].pointer);
+        delete regions[name];
+    }
+};
+
 const check = (k) => {
 
     if (typeof k !== 'number' || !Number.isInteger(k) || k <= 0) {
@@ -43,37 +108,145 @@ const check = (k) => {
 
 }
 
-export const getClustering = async (image) => {
+const checkAll = (ks) => {
+
+    if (!Array.isArray(ks) && !(ks instanceof Int32Array)) {
+        throw new Error("Invalid ks: must be an array of strictly positive integers.")
+    }
+
+    for (const k of ks) {check(k);}
+    return ks instanceof Int32Array ? ks : Int32Array.from(ks);
+
+}
+
+const checkIndexed = (k) => {
+
+    check(k);
+    if (k > 256) {
+        throw new Error("Invalid k: indexed output supports at most 256 colours.")
+    }
+
+}
+
+const alpha = (image, options) => {
+    return Boolean(options && options.alpha) && image.format === 'rgba';
+}
+
+// Resolves the approximate mode options. A quality in (0, 1] picks a sampling step and bit depth, and explicit sample,
+// bits and maxColors options override it. Quality 1 keeps every pixel at full depth.
+const approximation = (options) => {
+
+    const quality = options.quality === undefined ? 1 : options.quality;
+    if (typeof quality !== 'number' || !(quality > 0 && quality <= 1)) {
+        throw new Error("Invalid quality: must be a number in (0, 1].");
+    }
+
+    const sample = options.sample === undefined ? Math.max(1, Math.round(1 / quality)) : options.sample;
+    const bits = options.bits === undefined ? 4 + Math.round(4 * quality) : options.bits;
+    const maxColors = options.maxColors === undefined ? 0 : options.maxColors;
+
+    if (!Number.isInteger(sample) || sample < 1) {throw new Error("Invalid sample: must be a positive integer.");}
+    if (!Number.isInteger(bits) || bits < 1 || bits > 8) {throw new Error("Invalid bits: must be an integer from 1 to 8.");}
+    if (!Number.isInteger(maxColors) || maxColors < 0) {throw new Error("Invalid maxColors: must be a non-negative integer.");}
+
+    return {sample, random: options.random ? 1 : 0, bits, maxColors};
+
+};
+
+const report = (output) => {
+    const fields = new DataView(output.buffer, output.byteOffset, 24);
+    return {
+        sampledPixels: fields.getUint32(0, true),
+        totalPixels: fields.getUint32(4, true),
+        distinctColors: fields.getUint32(8, true),
+        reducedColors: fields.getUint32(12, true),
+        bits: fields.getUint32(16, true),
+        meanSquaredError: fields.getFloat32(20, true),
+    };
+};
+
+// Copies a batch of images one after another into a single region, and stages the pointer, length and weight arrays
+// the shared exports read them through. The weights pointer is null when every image counts once.
+const stageBatch = (images, options) => {
+
+    if (!Array.isArray(images) || images.length === 0) {
+        throw new Error("Invalid images: must be a non-empty array of images.");
+    }
+
+    images = images.map(load);
+    const format = images[0].format;
+    if (images.some((image) => image.format !== format)) {
+        throw new Error("Invalid images: must all have the same format.");
+    }
+
+    const weights = options.weights;
+    if (weights !== undefined && (!Array.isArray(weights) || weights.length !== images.length || weights.some((weight) => !Number.isInteger(weight) || weight < 0))) {
+        throw new Error("Invalid weights: must be one non-negative integer per image.");
+    }
+
+    const base = reserve('batch', images.reduce((total, image) => total + image.data.length, 0));
+    const pointers = new Uint32Array(images.length);
+    const lengths = new Int32Array(images.length);
+
+    let offset = 0;
+    images.forEach((image, i) => {
+        Module.HEAPU8.set(image.data, base + offset);
+        pointers[i] = base + offset;
+        lengths[i] = image.data.length;
+        offset += image.data.length;
+    });
+
+    return {
+        images,
+        format: codes[format],
+        pointers: stage('pointers', new Uint8Array(pointers.buffer)),
+        lengths: stage('lengths', new Uint8Array(lengths.buffer)),
+        weights: weights === undefined ? 0 : stage('weights', new Uint8Array(Int32Array.from(weights).buffer)),
+        offsets: pointers,
+    };
+
+};
+
+const engine = (options) => {
+
+    const name = (options && options.engine) || 'grid';
+    if (!Object.keys(engines).includes(name)) {
+        throw new Error("Invalid engine: must be 'grid', 'chain', 'reciprocal' or 'compact'.");
+    }
+
+    return engines[name];
+
+}
+
+export const getClustering = async (image, options = {}) => {
 
     await init();
     image = load(image);
+    const engineCode = engine(options);
 
-    const imagePointer = Module._malloc(image.data.length);
-    Module.HEAPU8.set(image.data, imagePointer);
+    const imagePointer = stage('image', image.data);
 
-    const outputPointer = Module._get_clustering(imagePointer, image.data.length, codes[image.format]);
+    const outputPointer = Module._get_clustering(imagePointer, image.data.length, codes[image.format], engineCode);
     const output = unpack(outputPointer);
 
-    Module._free(imagePointer);
     Module._free(outputPointer);
 
     return output;
 
 };
 
-export const getPalette = async (image, k) => {
+export const getPalette = async (image, k, options = {}) => {
 
     await init();
     image = load(image);
     check(k);
+    const engineCode = engine(options);
 
-    const imagePointer = Module._malloc(image.data.length);
-    Module.HEAPU8.set(image.data, imagePointer);
+    const imagePointer = stage('image', image.data);
 
-    const outputPointer = Module._get_palette(imagePointer, image.data.length, codes[image.format], k);
+    const outputPointer = Module._get_palette(imagePointer, image.data.length, codes[image.format], k, engineCode);
     const output = unpack(outputPointer);
 
-    Module._free(imagePointer);
     Module._free(outputPointer);
 
     return output;
@@ -85,77 +258,426 @@ export const getPaletteFromClustering = async (clustering, k) => {
     await init();
     check(k);
 
-    const clusteringPointer = Module._malloc(clustering.length);
-    Module.HEAPU8.set(clustering, clusteringPointer);
+    const clusteringPointer = stage('clustering', clustering);
 
     const outputPointer = Module._get_palette_from_clustering(clusteringPointer, clustering.length, k);
     const output = unpack(outputPointer);
 
-    Module._free(clusteringPointer);
     Module._free(outputPointer);
 
     return output;
 
 };
 
-export const quantize = async (image, k) => {
+// A dendrogram stores every merge by the nodes it joined, so palettes for any k are sliced out of it directly.
+export const getDendrogram = async (image, options = {}) => {
 
     await init();
     image = load(image);
+    const engineCode = engine(options);
+
+    const imagePointer = stage('image', image.data);
+
+    const outputPointer = Module._get_dendrogram(imagePointer, image.data.length, codes[image.format], engineCode);
+    const output = unpack(outputPointer);
+
+    Module._free(outputPointer);
+
+    return output;
+
+};
+
+export const getPaletteFromDendrogram = async (dendrogram, k) => {
+
+    await init();
+    check(k);
+
+    const dendrogramPointer = stage('dendrogram', dendrogram);
+
+    const outputPointer = Module._get_palette_from_dendrogram(dendrogramPointer, dendrogram.length, k);
+    const output = unpack(outputPointer);
+
+    Module._free(outputPointer);
+
+    return output;
+
+};
+
+export const getPalettesFromDendrogram = async (dendrogram, ks) => {
+
+    await init();
+    ks = checkAll(ks);
+
+    const dendrogramPointer = stage('dendrogram', dendrogram);
+    const ksPointer = stage('ks', new Uint8Array(ks.buffer, ks.byteOffset, ks.byteLength));
+
+    const outputPointer = Module._get_palettes_from_dendrogram(dendrogramPointer, dendrogram.length, ksPointer, ks.length);
+    const output = palettes(unpack(outputPointer));
+
+    Module._free(outputPointer);
+
+    return output;
+
+};
+
+export const getPalettes = async (image, ks, options = {}) => {
+
+    await init();
+    image = load(image);
+    ks = checkAll(ks);
+    const engineCode = engine(options);
+
+    const imagePointer = stage('image', image.data);
+    const ksPointer = stage('ks', new Uint8Array(ks.buffer, ks.byteOffset, ks.byteLength));
+
+    const outputPointer = Module._get_palettes(imagePointer, image.data.length, codes[image.format], ksPointer, ks.length, engineCode);
+    const output = palettes(unpack(outputPointer));
+
+    Module._free(outputPointer);
+
+    return output;
+
+};
+
+// Clusters a batch of images once, for example the frames of an animation or the sprites of a sheet, for one palette
+// they all share. Pass { weights: [...] } to count some images more than others.
+export const getSharedPalette = async (images, k, options = {}) => {
+
+    await init();
     check(k);
+    const engineCode = engine(options);
+    const batch = stageBatch(images, options);
+
+    const outputPointer = Module._get_shared_palette(batch.pointers, batch.lengths, batch.images.length, batch.format, batch.weights, k, engineCode);
+    const output = unpack(outputPointer);
+
+    Module._free(outputPointer);
+
+    return output;
+
+};
+
+// Quantizes every image of the batch against its shared palette, returning { palette, images }.
+export const quantizeShared = async (images, k, options = {}) => {
+
+    await init();
+    check(k);
+    const engineCode = engine(options);
+    const batch = stageBatch(images, options);
+
+    const outputPointer = Module._quantize_shared_into(batch.pointers, batch.lengths, batch.images.length, batch.format, batch.weights, k, engineCode, batch.pointers);
+    const palette = unpack(outputPointer);
+
+    Module._free(outputPointer);
+
+    const quantized = batch.images.map((image, i) => Module.HEAPU8.slice(batch.offsets[i], batch.offsets[i] + size(image)));
+    return {palette, images: quantized};
+
+};
+
+export const quantize = async (image, k, options = {}) => {
+
+    await init();
+    image = load(image);
+    check(k);
+    const engineCode = engine(options);
     
-    const imagePointer = Module._malloc(image.data.length);
-    Module.HEAPU8.set(image.data, imagePointer);
+    const imagePointer = stage('image', image.data);
+
+    if (options.view) {
+        const length = Module._quantize_into(imagePointer, image.data.length, codes[image.format], k, engineCode, reserve('output', size(image)));
+        return view('output', length);
+    }
 
-    const outputPointer = Module._quantize(imagePointer, image.data.length, codes[image.format], k);
+    const outputPointer = Module._quantize(imagePointer, image.data.length, codes[image.format], k, engineCode);
     const output = unpack(outputPointer);
 
-    Module._free(imagePointer);
     Module._free(outputPointer);
 
     return output;
 
 };
 
-export const quantizeWithClustering = async (image, clustering, k) => {
+export const quantizeWithClustering = async (image, clustering, k, options = {}) => {
 
     await init();
     image = load(image);
     check(k);
 
-    const imagePointer = Module._malloc(image.data.length);
-    const clusteringPointer = Module._malloc(clustering.length);
-    Module.HEAPU8.set(image.data, imagePointer);
-    Module.HEAPU8.set(clustering, clusteringPointer);
+    const imagePointer = stage('image', image.data);
+    const clusteringPointer = stage('clustering', clustering);
+
+    if (options.view) {
+        const length = Module._quantize_with_clustering_into(imagePointer, image.data.length, codes[image.format], clusteringPointer, clustering.length, k, reserve('output', size(image)));
+        return view('output', length);
+    }
 
     const outputPointer = Module._quantize_with_clustering(imagePointer, image.data.length, codes[image.format], clusteringPointer, clustering.length, k);
     const output = unpack(outputPointer);
 
-    Module._free(imagePointer);
-    Module._free(clusteringPointer);
     Module._free(outputPointer);
 
     return output;
 
 };
 
-export const quantizeWithPalette = async (image, palette) => {
+export const quantizeWithPalette = async (image, palette, options = {}) => {
 
     await init();
     image = load(image);
 
-    const imagePointer = Module._malloc(image.data.length);
-    const palettePointer = Module._malloc(palette.length);
-    Module.HEAPU8.set(image.data, imagePointer);
-    Module.HEAPU8.set(palette, palettePointer);
+    const imagePointer = stage('image', image.data);
+    const palettePointer = stage('palette', palette);
+
+    if (options.view) {
+        const length = Module._quantize_with_palette_into(imagePointer, image.data.length, codes[image.format], palettePointer, palette.length, reserve('output', size(image)));
+        return view('output', length);
+    }
 
     const outputPointer = Module._quantize_with_palette(imagePointer, image.data.length, codes[image.format], palettePointer, palette.length);
     const output = unpack(outputPointer);
 
-    Module._free(imagePointer);
-    Module._free(palettePointer);
     Module._free(outputPointer);
 
     return output;
 
+};
+
+export const quantizeIndexed = async (image, k, options = {}) => {
+
+    await init();
+    image = load(image);
+    checkIndexed(k);
+    const engineCode = engine(options);
+    const withAlpha = alpha(image, options);
+
+    const imagePointer = stage('image', image.data);
+
+    const outputPointer = Module._quantize_indexed(imagePointer, image.data.length, codes[image.format], k, engineCode, withAlpha ? 1 : 0);
+    const output = split(unpack(outputPointer), withAlpha);
+
+    Module._free(outputPointer);
+
+    return output;
+
+};
+
+export const quantizeWithClusteringIndexed = async (image, clustering, k, options = {}) => {
+
+    await init();
+    image = load(image);
+    checkIndexed(k);
+    const withAlpha = alpha(image, options);
+
+    const imagePointer = stage('image', image.data);
+    const clusteringPointer = stage('clustering', clustering);
+
+    const outputPointer = Module._quantize_with_clustering_indexed(imagePointer, image.data.length, codes[image.format], clusteringPointer, clustering.length, k, withAlpha ? 1 : 0);
+    const output = split(unpack(outputPointer), withAlpha);
+
+    Module._free(outputPointer);
+
+    return output;
+
+};
+
+export const quantizeWithPaletteIndexed = async (image, palette, options = {}) => {
+
+    await init();
+    image = load(image);
+    const withAlpha = alpha(image, options);
+
+    if (palette.length > 3 * 256) {
+        throw new Error("Invalid palette: indexed output supports at most 256 colours.");
+    }
+
+    const imagePointer = stage('image', image.data);
+    const palettePointer = stage('palette', palette);
+
+    const outputPointer = Module._quantize_with_palette_indexed(imagePointer, image.data.length, codes[image.format], palettePointer, palette.length, withAlpha ? 1 : 0);
+    const output = split(unpack(outputPointer), withAlpha);
+
+    Module._free(outputPointer);
+
+    return output;
+
+};
+
+export const getClusteringApproximate = async (image, options = {}) => {
+
+    await init();
+    image = load(image);
+    const engineCode = engine(options);
+    const {sample, random, bits, maxColors} = approximation(options);
+
+    const imagePointer = stage('image', image.data);
+
+    const outputPointer = Module._get_clustering_approximate(imagePointer, image.data.length, codes[image.format], engineCode, sample, random, bits, maxColors);
+    const output = unpack(outputPointer);
+
+    Module._free(outputPointer);
+
+    return {clustering: output.subarray(24), approximation: report(output)};
+
+};
+
+export const getPaletteApproximate = async (image, k, options = {}) => {
+
+    await init();
+    image = load(image);
+    check(k);
+    const engineCode = engine(options);
+    const {sample, random, bits, maxColors} = approximation(options);
+
+    const imagePointer = stage('image', image.data);
+
+    const outputPointer = Module._get_palette_approximate(imagePointer, image.data.length, codes[image.format], k, engineCode, sample, random, bits, maxColors);
+    const output = unpack(outputPointer);
+
+    Module._free(outputPointer);
+
+    return {palette: output.subarray(24), approximation: report(output)};
+
+};
+
+// Reports hot path counters and timers accumulated since the last reset. Only builds made with build:wasm:stats collect
+// them, others return {enabled: false}.
+export const getStats = async (options = {}) => {
+
+    await init();
+
+    const outputPointer = Module._get_stats(options.reset ? 1 : 0);
+    const output = unpack(outputPointer);
+
+    Module._free(outputPointer);
+
+    return JSON.parse(new TextDecoder().decode(output));
+
+};
+
+// Caps the threads each call of the multithreaded build uses, 0 restoring one per hardware thread. Single threaded
+// builds accept it and keep running on one.
+export const setThreadCount = async (threads) => {
+
+    await init();
+
+    if (typeof threads !== 'number' || !Number.isInteger(threads) || threads < 0) {
+        throw new Error("Invalid threads: must be a non-negative integer.");
+    }
+
+    Module._set_thread_count(threads);
+
+};
+
+// Counts an image fed in chunks of any size, for example rows as they come out of a decoder, so the whole image never
+// has to sit in WASM memory. finalize returns the same clustering getClustering would for the concatenated chunks.
+export const createSession = async (format = 'rgba', options = {}) => {
+
+    await init();
+    const engineCode = engine(options);
+
+    if (!Object.keys(codes).includes(format)) {
+        throw new Error("Invalid format: must be 'rgb' or 'rgba'.");
+    }
+
+    let session = Module._create_session(codes[format], engineCode);
+
+    const live = () => {
+        if (!session) {throw new Error("Invalid session: it has already been destroyed.");}
+    };
+
+    return {
+
+        feed: (chunk) => {
+            live();
+            if (!(chunk instanceof Uint8Array)) {throw new Error("Invalid chunk: must be Uint8Array.");}
+            const chunkPointer = stage('chunk', chunk);
+            Module._feed_pixels(session, chunkPointer, chunk.length);
+        },
+
+        finalize: () => {
+            live();
+            const outputPointer = Module._finalize_clustering(session);
+            const output = unpack(outputPointer);
+            Module._free(outputPointer);
+            return output;
+        },
+
+        finalizeDendrogram: () => {
+            live();
+            const outputPointer = Module._finalize_dendrogram(session);
+            const output = unpack(outputPointer);
+            Module._free(outputPointer);
+            return output;
+        },
+
+        destroy: () => {
+            if (!session) {return;}
+            Module._destroy_session(session);
+            session = null;
+        },
+
+    };
+
+};
+
+// Keeps a k colour palette across the frames of a video. Each frame only moves the colours that changed since the last
+// one, and the frame is clustered from scratch when more than maxChange of its pixels changed colour or the error rose
+// more than tolerance above that of the last full clustering, plus one squared channel unit of slack so a frame the
+// last clustering fit exactly is not clustered again on every change. The palette keeps its order between full clusterings.
+export const createPaletteTracker = async (format = 'rgba', k = 16, options = {}) => {
+
+    await init();
+    check(k);
+    const engineCode = engine(options);
+    const tolerance = options.tolerance ?? 0.1;
+    const maxChange = options.maxChange ?? 0.25;
+
+    if (!Object.keys(codes).includes(format)) {
+        throw new Error("Invalid format: must be 'rgb' or 'rgba'.");
+    }
+
+    if (typeof tolerance !== 'number' || !(tolerance >= 0)) {
+        throw new Error("Invalid tolerance: must be a non-negative number.");
+    }
+
+    if (typeof maxChange !== 'number' || !(maxChange >= 0 && maxChange <= 1)) {
+        throw new Error("Invalid maxChange: must be a number between 0 and 1.");
+    }
+
+    let tracker = Module._create_palette_tracker(codes[format], k, engineCode, tolerance, maxChange);
+
+    const live = () => {
+        if (!tracker) {throw new Error("Invalid tracker: it has already been destroyed.");}
+    };
+
+    return {
+
+        update: (frame) => {
+            live();
+            if (!(frame instanceof Uint8Array)) {throw new Error("Invalid frame: must be Uint8Array.");}
+            const framePointer = stage('frame', frame);
+            const outputPointer = Module._track_palette(tracker, framePointer, frame.length);
+            const output = unpack(outputPointer);
+            Module._free(outputPointer);
+
+            const fields = new DataView(output.buffer, output.byteOffset, 20);
+            return {
+                palette: output.subarray(20),
+                recomputed: fields.getUint32(0, true) === 1,
+                totalPixels: fields.getUint32(4, true),
+                changedPixels: fields.getUint32(8, true),
+                meanSquaredError: fields.getFloat32(12, true),
+                baselineError: fields.getFloat32(16, true),
+            };
+        },
+
+        destroy: () => {
+            if (!tracker) {return;}
+            Module._destroy_palette_tracker(tracker);
+            tracker = null;
+        },
+
+    };
+
 };
\ No newline at end of file
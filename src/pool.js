@@ -0,0 +1,164 @@
+// Runs the library on a pool of workers, each with its own WASM instance, so large images neither block the calling
+// thread nor wait behind each other. Every call goes to whichever worker is idle, or waits in line for the next one.
+export const methods = [
+    'getClustering', 'getPalette', 'getPaletteFromClustering', 'getDendrogram', 'getPaletteFromDendrogram',
+    'getPalettesFromDendrogram', 'getPalettes', 'getSharedPalette', 'quantizeShared', 'quantize', 'quantizeWithClustering',
+    'quantizeWithPalette', 'quantizeIndexed', 'quantizeWithClusteringIndexed', 'quantizeWithPaletteIndexed',
+    'getClusteringApproximate', 'getPaletteApproximate',
+];
+
+const node = typeof process !== 'undefined' && !!(process.versions && process.versions.node);
+
+// Collects the buffers behind every typed array of a value so they can be transferred rather than copied. With whole set
+// only buffers a view covers completely are taken, since transferring detaches everything else that shares them.
+export const buffers = (value, whole, found = new Set()) => {
+
+    if (ArrayBuffer.isView(value)) {
+        const buffer = value.buffer;
+        if (buffer instanceof ArrayBuffer && (!whole || (value.byteOffset === 0 && value.byteLength === buffer.byteLength))) {found.add(buffer);}
+    }
+    else if (Array.isArray(value)) {value.forEach((item) => buffers(item, whole, found));}
+    else if (value && typeof value === 'object') {Object.values(value).forEach((item) => buffers(item, whole, found));}
+
+    return [...found];
+
+};
+
+// Wraps worker_threads in Node and Web Workers in browsers behind the same few calls.
+const spawn = async (url) => {
+
+    if (node) {
+        const {Worker} = await import('node:worker_threads');
+        const worker = new Worker(url);
+        return {
+            post: (message, transfer) => worker.postMessage(message, transfer),
+            listen: (message, error) => {
+                worker.on('message', message);
+                worker.on('error', error);
+                worker.on('exit', (code) => error(new Error(`Worker exited with code ${code}.`)));
+            },
+            terminate: () => worker.terminate(),
+        };
+    }
+
+    const worker = new Worker(url, {type: 'module'});
+    return {
+        post: (message, transfer) => worker.postMessage(message, transfer),
+        listen: (message, error) => {worker.onmessage = (event) => message(event.data); worker.onerror = error;},
+        terminate: () => worker.terminate(),
+    };
+
+};
+
+const hardware = async () => {
+    if (!node) {return (typeof navigator !== 'undefined' && navigator.hardwareConcurrency) || 1;}
+    const os = await import('node:os');
+    return os.availableParallelism ? os.availableParallelism() : os.cpus().length;
+};
+
+// Starts size workers (default one per hardware thread) and resolves once all of them have loaded their WASM instance.
+// The pool has the same calls as the library. Inputs whose typed array covers its whole buffer are transferred to the
+// worker, which detaches them on the calling side, unless the pool is created with { transfer: false }. Results are
+// always transferred back. destroy() stops the workers and rejects the calls still waiting.
+export const createPool = async (options = {}) => {
+
+    const size = options.size ?? await hardware();
+    const url = options.worker || new URL('./worker.mjs', import.meta.url);
+    const transfer = options.transfer !== false;
+
+    if (typeof size !== 'number' || !Number.isInteger(size) || size <= 0) {
+        throw new Error("Invalid size: must be a strictly positive integer.");
+    }
+
+    const instances = new Set();
+    const idle = [];
+    const queue = [];
+    let closed = false;
+
+    const next = () => {
+        while (!closed && idle.length > 0 && queue.length > 0) {
+            const instance = idle.pop();
+            const task = queue.shift();
+            try {
+                instance.post({method: task.method, args: task.args}, task.transfer);
+                instance.task = task;
+            }
+            catch (error) {
+                idle.push(instance);
+                task.reject(error);
+            }
+        }
+    };
+
+    // A worker that dies fails the call it was running and is replaced, so the pool keeps its size.
+    const start = async () => {
+
+        const instance = await spawn(url);
+        instance.task = null;
+        instances.add(instance);
+        let ready = false;
+
+        await new Promise((resolve, reject) => {
+
+            instance.listen((message) => {
+                if ('ready' in message) {
+                    ready = message.ready;
+                    if (ready) {resolve();} else {reject(new Error(message.error));}
+                    return;
+                }
+                const task = instance.task;
+                instance.task = null;
+                idle.push(instance);
+                if ('error' in message) {task.reject(new Error(message.error));}
+                else {task.resolve(message.result);}
+                next();
+            }, (error) => {
+                reject(error);
+                if (!instances.has(instance)) {return;}
+                instances.delete(instance);
+                instance.terminate();
+                if (idle.includes(instance)) {idle.splice(idle.indexOf(instance), 1);}
+                if (instance.task) {instance.task.reject(error); instance.task = null;}
+                if (!closed && ready) {start().then(next, () => {});}
+            });
+
+        });
+
+        idle.push(instance);
+
+    };
+
+    try {
+        await Promise.all(Array.from({length: size}, start));
+    }
+    catch (error) {
+        closed = true;
+        await Promise.all([...instances].map((instance) => instance.terminate()));
+        throw error;
+    }
+
+    const call = (method, args) => new Promise((resolve, reject) => {
+        if (closed) {reject(new Error("Invalid pool: it has already been destroyed.")); return;}
+        queue.push({method, args, transfer: transfer ? buffers(args, true) : [], resolve, reject});
+        next();
+    });
+
+    const pool = {
+
+        size,
+
+        destroy: async () => {
+            if (closed) {return;}
+            closed = true;
+            const running = [...instances].filter((instance) => instance.task).map((instance) => instance.task);
+            for (const task of [...queue.splice(0), ...running]) {task.reject(new Error("Invalid pool: it has been destroyed."));}
+            await Promise.all([...instances].map((instance) => instance.terminate()));
+            instances.clear();
+        },
+
+    };
+
+    for (const method of methods) {pool[method] = (...args) => call(method, args);}
+    return pool;
+
+};
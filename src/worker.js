@@ -0,0 +1,52 @@
+// Entry point of the pool's workers. Each one loads its own WASM instance and runs the calls it is sent one at a time.
+// The import paths name the built modules in dist, which is where the pool loads this worker from.
+import * as clustering from './index.mjs';
+import {methods, buffers} from './pool.mjs';
+
+const connect = async () => {
+
+    if (typeof WorkerGlobalScope !== 'undefined' && self instanceof WorkerGlobalScope) {
+        return {
+            post: (message, transfer) => self.postMessage(message, transfer),
+            listen: (message) => {self.onmessage = (event) => message(event.data);},
+        };
+    }
+
+    const {parentPort} = await import('node:worker_threads');
+    return {
+        post: (message, transfer) => parentPort.postMessage(message, transfer),
+        listen: (message) => parentPort.on('message', message),
+    };
+
+};
+
+const serve = async () => {
+
+    const port = await connect();
+
+    try {
+        await clustering.init();
+    }
+    catch (error) {
+        port.post({ready: false, error: error && error.message ? error.message : String(error)});
+        return;
+    }
+
+    port.listen(async ({method, args}) => {
+        try {
+            if (!methods.includes(method)) {throw new Error(`Invalid method: ${method} cannot run on a pool.`);}
+            // Views of WASM memory cannot leave the worker, so results are always returned as copies of their own.
+            args = args.map((arg) => arg && typeof arg === 'object' && arg.view ? {...arg, view: false} : arg);
+            const result = await clustering[method](...args);
+            port.post({result}, buffers(result, false));
+        }
+        catch (error) {
+            port.post({error: error && error.message ? error.message : String(error)});
+        }
+    });
+
+    port.post({ready: true});
+
+};
+
+serve();
@@ -0,0 +1,105 @@
+// Checks that the nearest neighbour chain engine finds the same palettes as the coarsening grid engine. Centroid
+// linkage is not reducible, so the two merge in different orders in general, and since merged colours are rounded as
+// they go their colours may differ by one unit. Palettes are therefore compared as sets, within one unit per channel,
+// on images whose clusters are unambiguous.
+#include "clustering.h"
+#include <algorithm>
+#include <array>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <vector>
+
+using Color = std::array<int, 3>;
+
+size_t failures = 0;
+
+std::vector<Color> get_palette(std::vector<uint8_t>& image, int k, int engine) {
+
+    uint8_t* output = ::get_palette(image.data(), static_cast<int>(image.size()), 0, k, engine);
+    uint32_t length;
+    std::memcpy(&length, output, sizeof(length));
+
+    std::vector<Color> palette;
+    for (uint32_t i = 0; i + 2 < length; i += 3) {palette.push_back({output[4 + i], output[5 + i], output[6 + i]});}
+    std::free(output);
+
+    return palette;
+
+}
+
+// Pairs every colour of one palette with a distinct colour of the other within the tolerance.
+bool is_close(const std::vector<Color>& a, const std::vector<Color>& b, int tolerance) {
+
+    if (a.size() != b.size()) {return false;}
+    std::vector<bool> used(b.size(), false);
+
+    for (const Color& color : a) {
+        bool found = false;
+        for (size_t i = 0; i < b.size() && !found; i++) {
+            bool close = !used[i];
+            for (size_t c = 0; c < 3; c++) {close = close && std::abs(color[c] - b[i][c]) <= tolerance;}
+            if (close) {used[i] = true; found = true;}
+        }
+        if (!found) {return false;}
+    }
+
+    return true;
+
+}
+
+void compare(std::vector<uint8_t>& image, int k, int tolerance, const char* name, uint32_t seed) {
+    std::vector<Color> grid = get_palette(image, k, 0);
+    std::vector<Color> chain = get_palette(image, k, 1);
+    if (is_close(grid, chain, tolerance)) {return;}
+    failures++;
+    std::fprintf(stderr, "%s seed %u: the chain palette of %zu colours differs from the grid palette of %zu for k = %d\n", name, seed, chain.size(), grid.size(), k);
+}
+
+// Up to eight tight groups of colours, at least 64 apart on some channel. Cutting the tree into as many clusters as
+// there are groups must give each group's mean, and cutting it once must give the mean of the whole image.
+void test_groups(uint32_t seed) {
+
+    std::mt19937 random(seed);
+    int groups = 1 + static_cast<int>(random() % 8u);
+    std::vector<Color> centres;
+    while (static_cast<int>(centres.size()) < groups) {
+        Color centre = {int(16u + random() % 4u * 64u), int(16u + random() % 4u * 64u), int(16u + random() % 4u * 64u)};
+        if (std::find(centres.begin(), centres.end(), centre) == centres.end()) {centres.push_back(centre);}
+    }
+
+    std::vector<uint8_t> image;
+    size_t pixels = 50u + random() % 1500u;
+    for (size_t i = 0; i < pixels; i++) {
+        const Color& centre = centres[random() % centres.size()];
+        for (size_t c = 0; c < 3; c++) {image.push_back(static_cast<uint8_t>(centre[c] + int(random() % 17u) - 8));}
+        image.push_back(255u);
+    }
+
+    compare(image, groups, 1, "groups", seed);
+    compare(image, 1, 1, "groups", seed);
+
+}
+
+// With at least as many clusters as colours nothing is merged, so both palettes are exactly the image's colours.
+void test_unmerged(uint32_t seed) {
+
+    std::mt19937 random(seed);
+    std::vector<uint8_t> image(4u * (1u + random() % 200u));
+    for (uint8_t& value : image) {value = static_cast<uint8_t>(random());}
+
+    compare(image, 256, 0, "unmerged", seed);
+
+}
+
+int main() {
+
+    for (uint32_t seed = 1; seed <= 200; seed++) {test_groups(seed);}
+    for (uint32_t seed = 1; seed <= 100; seed++) {test_unmerged(seed);}
+
+    if (failures > 0) {std::fprintf(stderr, "%zu failures\n", failures); return 1;}
+    std::printf("chain palettes match the grid\n");
+    return 0;
+
+}
@@ -0,0 +1,134 @@
+// Checks the indexed dendrogram format: the root comes first, undoing merge j splits a node already on the frontier into
+// nodes 2j + 1 and 2j + 2, weights add up, and the palette for any k is the min(k, colours) frontier left after undoing
+// k - 1 merges, alone or batched.
+#include "clustering.h"
+#include <algorithm>
+#include <array>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <set>
+#include <vector>
+
+size_t failures = 0;
+
+struct Node {
+    std::array<uint8_t, 3> color;
+    uint32_t weight;
+    uint32_t left;
+    uint32_t right;
+};
+
+std::vector<uint8_t> unpack(uint8_t* output) {
+    uint32_t length;
+    std::memcpy(&length, output, sizeof(length));
+    std::vector<uint8_t> result(output + 4, output + 4 + length);
+    std::free(output);
+    return result;
+}
+
+uint32_t read_uint32(const uint8_t* data) {
+    uint32_t value;
+    std::memcpy(&value, data, sizeof(value));
+    return value;
+}
+
+std::vector<Node> parse(const std::vector<uint8_t>& dendrogram) {
+    std::vector<Node> nodes;
+    for (size_t i = 0; i + 16 <= dendrogram.size(); i += 16) {
+        const uint8_t* node = dendrogram.data() + i;
+        nodes.push_back(Node{{node[0], node[1], node[2]}, read_uint32(node + 4), read_uint32(node + 8), read_uint32(node + 12)});
+    }
+    return nodes;
+}
+
+void fail(const char* name, uint32_t seed, int engine, const char* message, size_t value) {
+    failures++;
+    std::fprintf(stderr, "%s seed %u engine %d: %s (%zu)\n", name, seed, engine, message, value);
+}
+
+void test_image(std::vector<uint8_t>& image, const char* name, uint32_t seed) {
+
+    int length = static_cast<int>(image.size());
+    std::set<std::array<uint8_t, 3>> distinct;
+    for (size_t i = 0; i < image.size(); i += 4) {distinct.insert({image[i], image[i + 1], image[i + 2]});}
+
+    for (int engine = 0; engine < 4; engine++) {
+
+        std::vector<uint8_t> dendrogram = unpack(get_dendrogram(image.data(), length, 0, engine));
+        std::vector<Node> nodes = parse(dendrogram);
+        if (nodes.size() != 2 * distinct.size() - 1) {fail(name, seed, engine, "wrong node count", nodes.size()); continue;}
+        if (nodes[0].weight != image.size() / 4) {fail(name, seed, engine, "the root does not weigh every pixel", nodes[0].weight);}
+
+        // Walk the merges from the root down, keeping the frontier of nodes a palette of that size would use.
+        std::vector<uint32_t> frontier = {0u};
+        std::vector<bool> split(nodes.size(), false);
+        for (size_t j = 0; 2 * j + 2 < nodes.size(); j++) {
+
+            uint32_t a = static_cast<uint32_t>(2 * j + 1);
+            uint32_t b = static_cast<uint32_t>(2 * j + 2);
+            auto parent = std::find_if(frontier.begin(), frontier.end(), [&](uint32_t id) {return nodes[id].left == a && nodes[id].right == b;});
+            if (parent == frontier.end()) {fail(name, seed, engine, "no frontier node splits into nodes 2j + 1 and 2j + 2 for j", j); break;}
+            if (nodes[*parent].weight != nodes[a].weight + nodes[b].weight) {fail(name, seed, engine, "a node does not weigh as much as its children", *parent);}
+
+            split[*parent] = true;
+            frontier.erase(parent);
+            frontier.push_back(a);
+            frontier.push_back(b);
+
+        }
+
+        for (size_t i = 0; i < nodes.size(); i++) {
+            bool leaf = nodes[i].left == 0;
+            if (leaf == split[i]) {fail(name, seed, engine, "a node's children disagree with the merges that split it", i);}
+        }
+
+        // Every k between 1 and past the colour count, one at a time and in one batch.
+        std::vector<int> ks;
+        for (int k = 1; k <= static_cast<int>(distinct.size()) + 2; k++) {ks.push_back(k);}
+        std::vector<uint8_t> batch = unpack(get_palettes_from_dendrogram(dendrogram.data(), static_cast<int>(dendrogram.size()), ks.data(), static_cast<int>(ks.size())));
+        size_t offset = 0;
+
+        for (int k : ks) {
+
+            std::vector<uint8_t> palette = unpack(get_palette_from_dendrogram(dendrogram.data(), static_cast<int>(dendrogram.size()), k));
+            size_t expected = std::min<size_t>(static_cast<size_t>(k), distinct.size());
+            if (palette.size() != 3 * expected) {fail(name, seed, engine, "a palette has the wrong size for k", static_cast<size_t>(k));}
+
+            // The palette is the frontier after undoing k - 1 merges, in node order.
+            std::vector<uint8_t> slice;
+            size_t top = 2 * expected - 1;
+            for (size_t i = 0; i < top; i++) {
+                if (nodes[i].left != 0 && nodes[i].left < top) {continue;}
+                slice.insert(slice.end(), nodes[i].color.begin(), nodes[i].color.end());
+            }
+            if (palette != slice) {fail(name, seed, engine, "a palette is not the frontier of its slice for k", static_cast<size_t>(k));}
+
+            bool batched = offset + 4 + palette.size() <= batch.size() && read_uint32(batch.data() + offset) == palette.size() / 3 && std::equal(palette.begin(), palette.end(), batch.begin() + offset + 4);
+            if (!batched) {fail(name, seed, engine, "the batched palette differs for k", static_cast<size_t>(k)); break;}
+            offset += 4 + palette.size();
+
+        }
+
+        if (offset != batch.size()) {fail(name, seed, engine, "the batch has trailing bytes", batch.size() - offset);}
+
+    }
+
+}
+
+int main() {
+
+    for (uint32_t seed = 1; seed <= 40; seed++) {
+        std::mt19937 random(seed);
+        uint32_t range = 2u << (seed % 4u * 2u);
+        std::vector<uint8_t> image(4u * (1u + random() % 400u));
+        for (uint8_t& value : image) {value = static_cast<uint8_t>(random() % range * (256u / range));}
+        test_image(image, "random", seed);
+    }
+
+    if (failures > 0) {std::fprintf(stderr, "%zu failures\n", failures); return 1;}
+    std::printf("dendrograms slice into palettes\n");
+    return 0;
+
+}
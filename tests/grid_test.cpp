@@ -0,0 +1,190 @@
+// Checks the coarsening grid against brute force closest pair searches while points are added, removed and merged,
+// one pair at a time or in rounds of reciprocal pairs.
+#include "clustering.hpp"
+#include <algorithm>
+#include <cstdio>
+#include <iterator>
+#include <limits>
+#include <random>
+#include <set>
+#include <vector>
+
+using Grid = AgglomerativeClustering::CoarseningGrid<>;
+using Point = Grid::Point;
+
+size_t failures = 0;
+
+uint64_t get_distance(const Point& a, const Point& b) {
+    uint64_t distance = 0;
+    for (size_t i = 0; i < 3; i++) {
+        uint64_t d = a[i] > b[i] ? a[i] - b[i] : b[i] - a[i];
+        distance += d * d;
+    }
+    return distance;
+}
+
+// The grid only links points whose cells touch at its current resolution, so the closest such pair is what it must
+// return. At resolution 0 every point shares one cell and this is the exact closest pair.
+uint64_t get_closest(const std::set<Point>& points, uint16_t resolution) {
+
+    uint16_t shift = Grid::BITS - resolution;
+    uint64_t closest = std::numeric_limits<uint64_t>::max();
+
+    for (auto a = points.begin(); a != points.end(); a++) {
+        for (auto b = std::next(a); b != points.end(); b++) {
+            bool touching = true;
+            for (size_t i = 0; i < 3; i++) {
+                int32_t difference = int32_t((*a)[i] >> shift) - int32_t((*b)[i] >> shift);
+                touching = touching && difference >= -1 && difference <= 1;
+            }
+            if (touching) {closest = std::min(closest, get_distance(*a, *b));}
+        }
+    }
+
+    return closest;
+
+}
+
+// Merges the closest pair into its midpoint, checking the pair the grid picked against the brute force one.
+bool merge(Grid& grid, std::set<Point>& points, const char* name, size_t step) {
+
+    auto nearest = grid.get_nearest();
+    if (!nearest) {
+        if (points.size() > 1) {failures++; std::fprintf(stderr, "%s step %zu: no pair among %zu points\n", name, step, points.size());}
+        return false;
+    }
+
+    auto [a, b] = *nearest;
+    uint64_t expected = get_closest(points, grid.get_resolution());
+    if (points.count(a) == 0 || points.count(b) == 0 || a == b || get_distance(a, b) != expected) {
+        failures++;
+        std::fprintf(stderr, "%s step %zu: picked a pair at %llu, the closest is at %llu\n", name, step, static_cast<unsigned long long>(get_distance(a, b)), static_cast<unsigned long long>(expected));
+        return false;
+    }
+
+    Point merged;
+    for (size_t i = 0; i < 3; i++) {merged[i] = static_cast<uint16_t>((uint32_t(a[i]) + b[i]) / 2u);}
+    grid.remove(a);
+    grid.remove(b);
+    points.erase(a);
+    points.erase(b);
+    grid.add(merged);
+    points.insert(merged);
+    return true;
+
+}
+
+Point random_point(std::mt19937& random, uint32_t range) {
+    std::uniform_int_distribution<uint32_t> coordinate(0u, range - 1u);
+    return {static_cast<uint16_t>(coordinate(random)), static_cast<uint16_t>(coordinate(random)), static_cast<uint16_t>(coordinate(random))};
+}
+
+// Few enough points to stay in a single cell at resolution 0, where the merge order must match brute force clustering.
+void test_merge_order(uint32_t seed) {
+
+    std::mt19937 random(seed);
+    Grid grid(0);
+    std::set<Point> points;
+    while (points.size() < 32) {points.insert(random_point(random, 65536u));}
+    grid.build(std::vector<Point>(points.begin(), points.end()));
+
+    for (size_t step = 0; merge(grid, points, "merge order", step); step++) {}
+    if (points.size() != 1) {failures++; std::fprintf(stderr, "merge order: %zu points left\n", points.size());}
+
+}
+
+// Dense random points spread over many buckets, with removals of arbitrary points between merges.
+void test_random_operations(uint32_t seed, uint32_t range) {
+
+    std::mt19937 random(seed);
+    Grid grid;
+    std::set<Point> points;
+    while (points.size() < 300) {points.insert(random_point(random, range));}
+    grid.build(std::vector<Point>(points.begin(), points.end()));
+
+    for (size_t step = 0; step < 600; step++) {
+
+        uint32_t operation = random() % 4u;
+        if (operation == 0 && !points.empty()) {
+            auto it = std::next(points.begin(), random() % points.size());
+            grid.remove(*it);
+            points.erase(it);
+        }
+        else if (operation == 1) {
+            Point point = random_point(random, range);
+            grid.add(point);
+            points.insert(point);
+        }
+        else if (!merge(grid, points, "random operations", step)) {break;}
+
+    }
+
+}
+
+uint64_t get_nearest_distance(const std::set<Point>& points, const Point& point, uint16_t resolution) {
+    uint16_t shift = Grid::BITS - resolution;
+    uint64_t nearest = std::numeric_limits<uint64_t>::max();
+    for (const Point& other : points) {
+        bool touching = other != point;
+        for (size_t i = 0; i < 3; i++) {
+            int32_t difference = int32_t(point[i] >> shift) - int32_t(other[i] >> shift);
+            touching = touching && difference >= -1 && difference <= 1;
+        }
+        if (touching) {nearest = std::min(nearest, get_distance(point, other));}
+    }
+    return nearest;
+}
+
+// Merges in rounds the way the reciprocal engine does, checking that every pair returned is mutually nearest.
+void test_reciprocal_rounds(uint32_t seed, uint32_t range) {
+
+    std::mt19937 random(seed);
+    Grid grid;
+    std::set<Point> points;
+    while (points.size() < 1000) {points.insert(random_point(random, range));}
+    grid.build(std::vector<Point>(points.begin(), points.end()));
+
+    for (size_t round = 0; points.size() > 1; round++) {
+
+        std::vector<std::pair<Point, Point>> pairs = grid.get_reciprocal_pairs(1);
+        if (pairs.empty()) {
+            if (!merge(grid, points, "reciprocal rounds", round)) {return;}
+            continue;
+        }
+
+        for (const auto& [a, b] : pairs) {
+            uint64_t distance = get_distance(a, b);
+            uint16_t resolution = grid.get_resolution();
+            if (points.count(a) == 0 || points.count(b) == 0 || distance != get_nearest_distance(points, a, resolution) || distance != get_nearest_distance(points, b, resolution)) {
+                failures++;
+                std::fprintf(stderr, "reciprocal rounds round %zu: a pair at %llu is not mutually nearest\n", round, static_cast<unsigned long long>(distance));
+                return;
+            }
+        }
+
+        for (const auto& [a, b] : pairs) {
+            Point merged;
+            for (size_t i = 0; i < 3; i++) {merged[i] = static_cast<uint16_t>((uint32_t(a[i]) + b[i]) / 2u);}
+            grid.remove(a);
+            grid.remove(b);
+            points.erase(a);
+            points.erase(b);
+            grid.add(merged);
+            points.insert(merged);
+        }
+
+    }
+
+}
+
+int main() {
+
+    for (uint32_t seed = 1; seed <= 100; seed++) {test_merge_order(seed);}
+    for (uint32_t seed = 1; seed <= 100; seed++) {test_random_operations(seed, 64u << (seed % 4));}
+    for (uint32_t seed = 1; seed <= 4; seed++) {test_reciprocal_rounds(seed, 1024u << seed);}
+
+    if (failures > 0) {std::fprintf(stderr, "%zu failures\n", failures); return 1;}
+    std::printf("grid matches brute force\n");
+    return 0;
+
+}
@@ -0,0 +1,67 @@
+// Checks that AgglomerativeHistogram keeps every pixel's weight through merges, including merges whose mean lands on a
+// colour that is already counted.
+#include "clustering.hpp"
+#include <cstdio>
+#include <random>
+#include <vector>
+
+size_t failures = 0;
+
+template <typename Histogram>
+uint64_t get_weight(const Histogram& histogram) {
+    uint64_t weight = 0;
+    for (const auto& [point, count] : histogram) {weight += count;}
+    return weight;
+}
+
+// Merging {0, 0, 0} x 1 and {4, 4, 4} x 1 gives {2, 2, 2}, which already weighs 3, so it must end up weighing 5.
+template <typename Coordinate>
+void test_collision(const char* name) {
+
+    using Histogram = AgglomerativeClustering::AgglomerativeHistogram<Coordinate, 3>;
+    Histogram histogram;
+    histogram.count({0, 0, 0});
+    histogram.count({4, 4, 4});
+    histogram.count({2, 2, 2}, 3u);
+
+    auto merged = histogram.merge({0, 0, 0}, {4, 4, 4});
+    if (merged != typename Histogram::Point{2, 2, 2}) {failures++; std::fprintf(stderr, "%s: merged into the wrong colour\n", name);}
+    if (histogram.size() != 1u || get_weight(histogram) != 5u) {failures++; std::fprintf(stderr, "%s: %zu colours weighing %llu after merging into a counted one\n", name, histogram.size(), static_cast<unsigned long long>(get_weight(histogram)));}
+
+}
+
+// Random merges of few, close colours collide often, and none of them may lose weight.
+void test_random(uint32_t seed) {
+
+    std::mt19937 random(seed);
+    using Histogram = AgglomerativeClustering::AgglomerativeHistogram<uint8_t, 3>;
+    Histogram histogram;
+    uint64_t total = 0;
+    for (size_t i = 0; i < 200; i++) {
+        uint32_t count = 1u + random() % 5u;
+        histogram.count({static_cast<uint8_t>(random() % 4u), static_cast<uint8_t>(random() % 4u), static_cast<uint8_t>(random() % 4u)}, count);
+        total += count;
+    }
+
+    while (histogram.size() > 1) {
+        std::vector<Histogram::Point> points;
+        for (const auto& [point, count] : histogram) {points.push_back(point);}
+        size_t a = random() % points.size();
+        size_t b = (a + 1u + random() % (points.size() - 1u)) % points.size();
+        histogram.merge(points[a], points[b]);
+        if (get_weight(histogram) != total) {failures++; std::fprintf(stderr, "random seed %u: a merge lost weight\n", seed); return;}
+    }
+
+}
+
+int main() {
+
+    test_collision<uint8_t>("8-bit");
+    test_collision<uint16_t>("16-bit");
+    for (uint32_t seed = 1; seed <= 50; seed++) {test_random(seed);}
+
+    if (failures > 0) {std::fprintf(stderr, "%zu failures\n", failures); return 1;}
+    std::printf("histogram merges keep their weight\n");
+    return 0;
+
+}
@@ -0,0 +1,51 @@
+// Checks every PaletteMatcher strategy against a brute force search for the earliest of the nearest palette entries.
+#include "clustering.hpp"
+#include <cstdio>
+#include <random>
+#include <vector>
+
+size_t get_expected(const std::vector<std::array<uint8_t, 3>>& palette, const std::array<uint8_t, 3>& color) {
+
+    size_t best = 0;
+    uint32_t best_distance = std::numeric_limits<uint32_t>::max();
+    for (size_t i = 0; i < palette.size(); i++) {
+        uint32_t distance = 0;
+        for (size_t c = 0; c < 3; c++) {distance += uint32_t((int(palette[i][c]) - color[c]) * (int(palette[i][c]) - color[c]));}
+        if (distance < best_distance) {best = i; best_distance = distance;}
+    }
+
+    return best;
+
+}
+
+int main() {
+
+    size_t failures = 0;
+    std::mt19937 random(7);
+
+    // Coarse palette colours and queries make equally near entries common, and coarse palettes repeat colours too.
+    for (size_t size : {100u, 1000u, 6000u}) {
+        for (size_t queries : {size_t(0), size_t(1) << 24}) {
+
+            std::vector<std::array<uint8_t, 3>> palette(size);
+            for (auto& color : palette) {color = {uint8_t(random() % 16u * 16u), uint8_t(random() % 16u * 16u), uint8_t(random() % 16u * 16u)};}
+
+            AgglomerativeClustering::PaletteMatcher matcher;
+            matcher.build(palette, queries);
+
+            for (size_t i = 0; i < 20000; i++) {
+                std::array<uint8_t, 3> color = {uint8_t(random() % 32u * 8u), uint8_t(random() % 32u * 8u), uint8_t(random() % 32u * 8u)};
+                size_t expected = get_expected(palette, color);
+                size_t found = matcher.get_nearest_index(color);
+                if (found == expected) {continue;}
+                if (failures++ < 10) {std::fprintf(stderr, "palette of %zu for %zu queries: entry %zu instead of %zu\n", size, queries, found, expected);}
+            }
+
+        }
+    }
+
+    if (failures > 0) {std::fprintf(stderr, "%zu failures\n", failures); return 1;}
+    std::printf("matcher matches brute force\n");
+    return 0;
+
+}
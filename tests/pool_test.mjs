@@ -0,0 +1,23 @@
+// Smoke test of the built package: a call run through a worker pool must return what it returns on the calling thread.
+import {getPalette} from '../dist/index.mjs';
+import {createPool} from '../dist/pool.mjs';
+
+const image = new Uint8Array(4 * 64 * 64);
+for (let i = 0; i < image.length; i++) {image[i] = (i * 37) ^ (i >> 5);}
+
+const expected = await getPalette(image.slice(), 8);
+const pool = await createPool({size: 2});
+
+try {
+    const palettes = await Promise.all([pool.getPalette(image.slice(), 8), pool.getPalette(image.slice(), 8)]);
+    for (const palette of palettes) {
+        if (palette.length !== expected.length || palette.some((value, i) => value !== expected[i])) {
+            console.error(`pool palette ${palette} differs from ${expected}`);
+            process.exit(1);
+        }
+    }
+    console.log(`pool matches the calling thread: ${expected.length / 3} colours`);
+}
+finally {
+    await pool.destroy();
+}
@@ -0,0 +1,86 @@
+// Checks that a streaming session fed an image in chunks of any size, whole pixels or not, finalizes to exactly the
+// bytes the one-shot calls return for the whole image, with every engine.
+#include "clustering.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <vector>
+
+size_t failures = 0;
+
+std::vector<uint8_t> unpack(uint8_t* output) {
+    uint32_t length;
+    std::memcpy(&length, output, sizeof(length));
+    std::vector<uint8_t> result(output + 4, output + 4 + length);
+    std::free(output);
+    return result;
+}
+
+// Splits the image at random points, from single bytes to most of it, and feeds the pieces in order.
+Session* feed(std::vector<uint8_t>& image, int format, int engine, std::mt19937& random) {
+
+    Session* session = create_session(format, engine);
+    size_t largest = std::max<size_t>(1u, image.size() / (1u + random() % 8u));
+
+    for (size_t offset = 0; offset < image.size();) {
+        size_t length = std::min<size_t>(image.size() - offset, 1u + random() % largest);
+        feed_pixels(session, image.data() + offset, static_cast<int>(length));
+        offset += length;
+    }
+
+    return session;
+
+}
+
+void test_image(std::vector<uint8_t>& image, int format, const char* name, uint32_t seed) {
+
+    std::mt19937 random(seed);
+    int length = static_cast<int>(image.size());
+
+    for (int engine = 0; engine < 4; engine++) {
+
+        Session* session = feed(image, format, engine, random);
+        std::vector<uint8_t> clustering = unpack(finalize_clustering(session));
+        destroy_session(session);
+        if (clustering != unpack(get_clustering(image.data(), length, format, engine))) {
+            failures++;
+            std::fprintf(stderr, "%s seed %u engine %d: the session clustering differs from get_clustering\n", name, seed, engine);
+        }
+
+        session = feed(image, format, engine, random);
+        std::vector<uint8_t> dendrogram = unpack(finalize_dendrogram(session));
+        destroy_session(session);
+        if (dendrogram != unpack(get_dendrogram(image.data(), length, format, engine))) {
+            failures++;
+            std::fprintf(stderr, "%s seed %u engine %d: the session dendrogram differs from get_dendrogram\n", name, seed, engine);
+        }
+
+    }
+
+}
+
+int main() {
+
+    // Small random images in both formats, with few or many repeated colours.
+    for (uint32_t seed = 1; seed <= 40; seed++) {
+        std::mt19937 random(seed);
+        int format = static_cast<int>(seed % 2u);
+        uint32_t range = 4u << (seed % 4u * 2u);
+        std::vector<uint8_t> image((format == 1 ? 3u : 4u) * (1u + random() % 3000u));
+        for (uint8_t& value : image) {value = static_cast<uint8_t>(random() % range * (256u / range));}
+        test_image(image, format, "random", seed);
+    }
+
+    // Past a million pixels the histogram counts into tables rather than sorting, on the whole image and on large chunks.
+    std::vector<uint8_t> large(4u * 1200000u);
+    std::mt19937 random(0);
+    for (uint8_t& value : large) {value = static_cast<uint8_t>(random() % 4u * 64u);}
+    test_image(large, 0, "large", 0);
+
+    if (failures > 0) {std::fprintf(stderr, "%zu failures\n", failures); return 1;}
+    std::printf("sessions match one-shot clustering\n");
+    return 0;
+
+}
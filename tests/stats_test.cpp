@@ -0,0 +1,36 @@
+// Builds the library with AGGLOMERATIVE_CLUSTERING_STATS and checks get_stats reports every counter after a quantization.
+#include "clustering.h"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+std::string unpack(uint8_t* output) {
+    uint32_t length;
+    std::memcpy(&length, output, sizeof(length));
+    std::string result(reinterpret_cast<const char*>(output + 4), length);
+    std::free(output);
+    return result;
+}
+
+int main() {
+
+    std::vector<uint8_t> image(4 * 64 * 64);
+    for (size_t i = 0; i < image.size(); i++) {image[i] = static_cast<uint8_t>((i * 37u) ^ (i >> 5));}
+
+    std::free(get_stats(1));
+    std::free(quantize(image.data(), static_cast<int>(image.size()), 0, 8, 0));
+    std::string json = unpack(get_stats(0));
+
+    const char* names[] = {"\"enabled\":true", "histogramNanoseconds", "\"histogramPixels\":4096,", "distinctColors", "clusteringNanoseconds", "gridCoarsenings", "gridCoarsenNanoseconds", "gridRefinements", "gridRefineNanoseconds", "gridBucketScans", "gridCacheOperations", "kdtreeQueries", "kdtreeNodesVisited", "quantizeNanoseconds", "\"quantizedPixels\":4096,", "peakMemoryBytes"};
+    for (const char* name : names) {
+        if (json.find(name) != std::string::npos) {continue;}
+        std::fprintf(stderr, "get_stats is missing %s: %s\n", name, json.c_str());
+        return 1;
+    }
+
+    std::printf("%s\n", json.c_str());
+    return 0;
+
+}
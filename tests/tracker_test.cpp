@@ -0,0 +1,141 @@
+// Checks that a palette tracker clusters a frame again only when its mean squared error exceeds the baseline of the last
+// exact clustering plus tolerance and TRACKER_ERROR_SLACK, when a cluster empties, or when too many pixels change.
+#include "clustering.h"
+#include <array>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <vector>
+
+using Color = std::array<uint8_t, 3>;
+
+// Mirrors TRACKER_ERROR_SLACK in clustering.cpp.
+constexpr double SLACK = 1.0;
+
+size_t failures = 0;
+
+struct Report {
+    uint32_t recomputed;
+    uint32_t total_pixels;
+    uint32_t changed_pixels;
+    float error;
+    float baseline;
+    size_t colors;
+};
+
+Report track(PaletteTracker* tracker, std::vector<uint8_t>& image) {
+
+    uint8_t* output = track_palette(tracker, image.data(), static_cast<int>(image.size()));
+    uint32_t length;
+    std::memcpy(&length, output, sizeof(length));
+
+    Report report;
+    std::memcpy(&report.recomputed, output + 4, sizeof(uint32_t));
+    std::memcpy(&report.total_pixels, output + 8, sizeof(uint32_t));
+    std::memcpy(&report.changed_pixels, output + 12, sizeof(uint32_t));
+    std::memcpy(&report.error, output + 16, sizeof(float));
+    std::memcpy(&report.baseline, output + 20, sizeof(float));
+    report.colors = (length - 20u) / 3u;
+    std::free(output);
+
+    return report;
+
+}
+
+std::vector<uint8_t> make_frame(const std::vector<std::pair<Color, size_t>>& runs) {
+    std::vector<uint8_t> image;
+    for (const auto& [color, count] : runs) {
+        for (size_t i = 0; i < count; i++) {image.insert(image.end(), {color[0], color[1], color[2], 255u});}
+    }
+    return image;
+}
+
+void expect(const char* frame, const Report& report, uint32_t recomputed, size_t colors) {
+    if (report.recomputed == recomputed && report.colors == colors) {return;}
+    failures++;
+    std::fprintf(stderr, "frame %s: recomputed %u with %zu colours, expected %u with %zu\n", frame, report.recomputed, report.colors, recomputed, colors);
+}
+
+// Two far apart groups at k = 2, each frame built so that exactly one rule decides whether the palette is clustered again.
+void test_rules() {
+
+    const Color black = {0, 0, 0};
+    const Color red = {1, 0, 0};
+    const Color grey = {200, 200, 200};
+    PaletteTracker* tracker = create_palette_tracker(0, 2, 0, 1.0f, 0.25f);
+
+    std::vector<uint8_t> a = make_frame({{black, 500}, {grey, 500}});
+    expect("a, the first frame", track(tracker, a), 1, 2);
+    expect("a again, nothing changed", track(tracker, a), 0, 2);
+
+    // A baseline of 0 leaves only the slack: 10 pixels one unit off raise the error to about 0.01.
+    std::vector<uint8_t> b = make_frame({{black, 500}, {grey, 490}, {{201, 200, 200}, 10}});
+    expect("b, within the slack", track(tracker, b), 0, 2);
+
+    // 100 pixels ten units off raise the error to 8, past the slack over a baseline of 0.
+    std::vector<uint8_t> c = make_frame({{black, 500}, {grey, 400}, {{210, 200, 200}, 100}});
+    Report report = track(tracker, c);
+    expect("c, past the slack", report, 1, 2);
+    if (report.baseline < 7.9f || report.baseline > 8.1f) {failures++; std::fprintf(stderr, "frame c: a baseline of %f, expected 8\n", report.baseline);}
+
+    // 10.5 stays under 8 * (1 + 1) + 1, while 72 does not.
+    std::vector<uint8_t> d = make_frame({{black, 500}, {grey, 350}, {{210, 200, 200}, 150}});
+    expect("d, within the tolerance", track(tracker, d), 0, 2);
+    std::vector<uint8_t> e = make_frame({{black, 500}, {grey, 400}, {{230, 200, 200}, 100}});
+    expect("e, past the tolerance", track(tracker, e), 1, 2);
+
+    // 300 of 1000 pixels change by one unit, which barely moves the error but is more than a quarter of the frame.
+    std::vector<uint8_t> f = make_frame({{black, 200}, {red, 300}, {grey, 400}, {{230, 200, 200}, 100}});
+    expect("f, too many changed pixels", track(tracker, f), 1, 2);
+
+    // The dark cluster loses every pixel while the rest fits exactly, so only the empty cluster calls for clustering.
+    std::vector<uint8_t> g = make_frame({{grey, 500}});
+    expect("g, an emptied cluster", track(tracker, g), 1, 1);
+
+    destroy_palette_tracker(tracker);
+
+}
+
+// Random videos drifting a few colours at a time, where every frame kept must have stayed within every rule.
+void test_random(uint32_t seed) {
+
+    std::mt19937 random(seed);
+    float tolerance = float(random() % 4u) * 0.25f;
+    float max_change = 0.05f + float(random() % 4u) * 0.1f;
+    PaletteTracker* tracker = create_palette_tracker(0, 1 + static_cast<int>(random() % 8u), 0, tolerance, max_change);
+
+    std::vector<uint8_t> image(4u * 2000u);
+    for (size_t i = 0; i < image.size(); i++) {image[i] = i % 4u == 3u ? 255u : static_cast<uint8_t>(random() % 8u * 32u);}
+    Report previous = track(tracker, image);
+
+    for (size_t frame = 1; frame < 40; frame++) {
+
+        size_t changes = random() % 300u;
+        for (size_t i = 0; i < changes; i++) {image[4u * (random() % 2000u) + random() % 3u] = static_cast<uint8_t>(random() % 8u * 32u + random() % 3u);}
+        Report report = track(tracker, image);
+
+        bool kept = report.recomputed == 0;
+        bool within = report.error <= double(previous.baseline) * (1.0 + tolerance) + SLACK + 1e-3 && double(report.changed_pixels) <= double(max_change) * report.total_pixels;
+        if (kept && (!within || report.baseline != previous.baseline || report.colors != previous.colors)) {
+            failures++;
+            std::fprintf(stderr, "random seed %u frame %zu: kept an error of %f over a baseline of %f with %u of %u pixels changed\n", seed, frame, report.error, previous.baseline, report.changed_pixels, report.total_pixels);
+        }
+        previous = report;
+
+    }
+
+    destroy_palette_tracker(tracker);
+
+}
+
+int main() {
+
+    test_rules();
+    for (uint32_t seed = 1; seed <= 20; seed++) {test_random(seed);}
+
+    if (failures > 0) {std::fprintf(stderr, "%zu failures\n", failures); return 1;}
+    std::printf("the tracker reclusters only when it must\n");
+    return 0;
+
+}